@@ -0,0 +1,338 @@
+// Times extraction and PLY export over a matrix of fields, lattice resolutions and thread counts, and writes the
+// results out as JSON so runs can be compared between releases.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "MarchingCubes.h"
+#include "Classify.h"
+#include "Fields.h"
+
+const char* USAGE =
+	"Usage: marching_cubes_bench [options]\n"
+	"  --fields LIST       Comma separated fields from f1, f2, sphere, noise (default all of them)\n"
+	"  --resolutions LIST  Cells along each axis (default 64,128,256)\n"
+	"  --threads LIST      Thread counts (default 1 and one per hardware thread)\n"
+	"  --repeat N          Runs per case, the fastest is reported (default 3)\n"
+	"  --out PATH          JSON report to write (default benchmark.json)\n"
+	"  --ply PATH          Scratch file for timing PLY export, deleted afterwards (default benchmark_export.ply)\n";
+
+const float DOMAIN_MIN = -5, DOMAIN_MAX = 5;
+
+struct Settings {
+	std::vector<std::string> fields = { "f1", "f2", "sphere", "noise" };
+	std::vector<int> resolutions = { 64, 128, 256 };
+	std::vector<int> threads;
+	int repeat = 3;
+	std::string out = "benchmark.json";
+	std::string ply = "benchmark_export.ply";
+};
+
+struct ExtractionResult {
+	std::string field;
+	int resolution = 0;
+	int threads = 0;
+	MarchingCubes::ExtractStats stats;
+	size_t peak_rss = 0;
+};
+
+// Single threaded extraction of one field through the inlined extract<Field> and through a std::function
+struct DispatchResult {
+	std::string field;
+	int resolution = 0;
+	size_t cells = 0;
+	double lambda_seconds = 0, function_seconds = 0;
+};
+
+struct ExportResult {
+	std::string field;
+	int resolution = 0;
+	std::string format;
+	size_t bytes = 0;
+	double seconds = 0;
+};
+
+// Starts a new peak for peak_rss(). Only Linux can do this, elsewhere the peak covers the whole process so far.
+void reset_peak_rss() {
+#ifdef __linux__
+	std::ofstream clear_refs("/proc/self/clear_refs");
+	clear_refs << "5";
+#endif
+}
+
+// Most memory the process has had resident since the last reset_peak_rss(), in bytes
+size_t peak_rss() {
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize;
+	return 0;
+#else
+#ifdef __linux__
+	// VmHWM is what clear_refs resets, ru_maxrss isn't
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line))
+		if (line.compare(0, 6, "VmHWM:") == 0)
+			return std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+#endif
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return (size_t)usage.ru_maxrss;
+#else
+	return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+bool parse_list(const std::string& text, std::vector<std::string>& out) {
+	out.clear();
+	std::stringstream stream(text);
+	std::string item;
+	while (std::getline(stream, item, ','))
+		if (!item.empty())
+			out.push_back(item);
+	return !out.empty();
+}
+
+bool parse_list(const std::string& text, std::vector<int>& out) {
+	std::vector<std::string> items;
+	if (!parse_list(text, items))
+		return false;
+
+	out.clear();
+	for (const std::string& item : items) {
+		char* end;
+		long value = std::strtol(item.c_str(), &end, 10);
+		if (*end != '\0' || value <= 0)
+			return false;
+		out.push_back((int)value);
+	}
+	return true;
+}
+
+bool parse_arguments(int argc, char** argv, Settings& settings) {
+	for (int a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+		if (arg == "--help" || arg == "-h" || a + 1 >= argc)
+			return false;
+
+		std::string value = argv[++a];
+		std::vector<int> repeat;
+		bool ok = true;
+		if (arg == "--fields")
+			ok = parse_list(value, settings.fields);
+		else if (arg == "--resolutions")
+			ok = parse_list(value, settings.resolutions);
+		else if (arg == "--threads")
+			ok = parse_list(value, settings.threads);
+		else if (arg == "--repeat") {
+			ok = parse_list(value, repeat) && repeat.size() == 1;
+			if (ok)
+				settings.repeat = repeat[0];
+		}
+		else if (arg == "--out")
+			settings.out = value;
+		else if (arg == "--ply")
+			settings.ply = value;
+		else
+			ok = false;
+
+		if (!ok) {
+			std::cout << "Bad option: " << arg << " " << value << std::endl;
+			return false;
+		}
+	}
+
+	if (settings.threads.empty()) {
+		settings.threads.push_back(1);
+		unsigned hardware = std::thread::hardware_concurrency();
+		if (hardware > 1)
+			settings.threads.push_back((int)hardware);
+	}
+	return true;
+}
+
+// Times the field passed as itself, so extract<Field> inlines it into the sampling loop, against the same field behind
+// a std::function, which costs an indirect call per lattice point. On one thread, so the difference is per cell
+// rather than lost in how the slabs balance. The two take turns, and the fastest of the repeats is kept for each.
+template <typename Field>
+DispatchResult time_dispatch(const Field& field, const std::string& name, int resolution, const Settings& settings) {
+	const float stepsize = (DOMAIN_MAX - DOMAIN_MIN) / resolution;
+	const std::function<float(float, float, float)> wrapped = field;
+
+	MarchingCubes::Options options;
+	options.publish = false;
+	options.threads = 1;
+
+	DispatchResult result;
+	result.field = name;
+	result.resolution = resolution;
+	for (int r = 0; r < settings.repeat; r++) {
+		MarchingCubes::clear(options);
+		MarchingCubes::ExtractStats inlined = MarchingCubes::extract(field, 0, DOMAIN_MIN, DOMAIN_MAX, stepsize, options);
+		MarchingCubes::clear(options);
+		MarchingCubes::ExtractStats called = MarchingCubes::extract(wrapped, 0, DOMAIN_MIN, DOMAIN_MAX, stepsize, options);
+
+		result.cells = inlined.cells;
+		if (r == 0 || inlined.seconds < result.lambda_seconds)
+			result.lambda_seconds = inlined.seconds;
+		if (r == 0 || called.seconds < result.function_seconds)
+			result.function_seconds = called.seconds;
+	}
+	MarchingCubes::clear(options);
+	return result;
+}
+
+// Extracts the field at every thread count, keeping the fastest of the repeats, then times exporting the last mesh
+// and the cost of calling the field through a std::function
+template <typename Field>
+void run_field(const Field& field, const std::string& name, int resolution, const Settings& settings,
+			   std::vector<ExtractionResult>& extractions, std::vector<ExportResult>& exports,
+			   std::vector<DispatchResult>& dispatches) {
+	const float stepsize = (DOMAIN_MAX - DOMAIN_MIN) / resolution;
+
+	MarchingCubes::Options options;
+	options.publish = false;
+
+	for (int threads : settings.threads) {
+		options.threads = threads;
+
+		ExtractionResult result;
+		result.field = name;
+		result.resolution = resolution;
+		result.threads = threads;
+
+		reset_peak_rss();
+		for (int r = 0; r < settings.repeat; r++) {
+			MarchingCubes::clear(options);
+			MarchingCubes::ExtractStats stats = MarchingCubes::extract(field, 0, DOMAIN_MIN, DOMAIN_MAX, stepsize, options);
+			if (r == 0 || stats.seconds < result.stats.seconds)
+				result.stats = stats;
+		}
+		result.peak_rss = peak_rss();
+		extractions.push_back(result);
+	}
+
+	const MarchingCubes::PLYFormat formats[] = { MarchingCubes::PLYFormat::Ascii, MarchingCubes::PLYFormat::Binary };
+	for (MarchingCubes::PLYFormat format : formats) {
+		ExportResult result;
+		result.field = name;
+		result.resolution = resolution;
+		result.format = format == MarchingCubes::PLYFormat::Binary ? "binary" : "ascii";
+
+		auto start = std::chrono::steady_clock::now();
+		result.bytes = MarchingCubes::write_ply(settings.ply, format);
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		result.seconds = elapsed.count();
+		exports.push_back(result);
+	}
+	std::remove(settings.ply.c_str());
+
+	MarchingCubes::clear(options);
+	dispatches.push_back(time_dispatch(field, name, resolution, settings));
+}
+
+// Rate per second, or 0 if the run was too quick to time
+double per_second(double amount, double seconds) {
+	return seconds > 0 ? amount / seconds : 0;
+}
+
+void write_report(std::ostream& out, const std::vector<ExtractionResult>& extractions,
+				  const std::vector<ExportResult>& exports, const std::vector<DispatchResult>& dispatches) {
+	out << "{\n";
+	out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+	out << "  \"classifier\": \"" << classifier_name(true) << "\",\n";
+	out << "  \"domain\": [" << DOMAIN_MIN << ", " << DOMAIN_MAX << "],\n";
+
+	out << "  \"extraction\": [";
+	for (size_t i = 0; i < extractions.size(); i++) {
+		const ExtractionResult& r = extractions[i];
+		out << (i == 0 ? "\n" : ",\n");
+		out << "    {\"field\": \"" << r.field << "\", \"resolution\": " << r.resolution << ", \"threads\": " << r.threads
+			<< ", \"cells\": " << r.stats.cells << ", \"triangles\": " << r.stats.triangles
+			<< ", \"vertices\": " << r.stats.vertices << ", \"field_evaluations\": " << r.stats.field_evaluations
+			<< ", \"seconds\": " << r.stats.seconds
+			<< ", \"cells_per_second\": " << per_second((double)r.stats.cells, r.stats.seconds)
+			<< ", \"triangles_per_second\": " << per_second((double)r.stats.triangles, r.stats.seconds)
+			<< ", \"peak_rss_bytes\": " << r.peak_rss << "}";
+	}
+	out << "\n  ],\n";
+
+	out << "  \"export\": [";
+	for (size_t i = 0; i < exports.size(); i++) {
+		const ExportResult& r = exports[i];
+		out << (i == 0 ? "\n" : ",\n");
+		out << "    {\"field\": \"" << r.field << "\", \"resolution\": " << r.resolution << ", \"format\": \"" << r.format
+			<< "\", \"bytes\": " << r.bytes << ", \"seconds\": " << r.seconds
+			<< ", \"megabytes_per_second\": " << per_second(r.bytes / (1024.0 * 1024.0), r.seconds) << "}";
+	}
+	out << "\n  ],\n";
+
+	out << "  \"field_dispatch\": [";
+	for (size_t i = 0; i < dispatches.size(); i++) {
+		const DispatchResult& r = dispatches[i];
+		out << (i == 0 ? "\n" : ",\n");
+		out << "    {\"field\": \"" << r.field << "\", \"resolution\": " << r.resolution << ", \"threads\": 1"
+			<< ", \"cells\": " << r.cells
+			<< ", \"lambda_cells_per_second\": " << per_second((double)r.cells, r.lambda_seconds)
+			<< ", \"std_function_cells_per_second\": " << per_second((double)r.cells, r.function_seconds) << "}";
+	}
+	out << "\n  ]\n";
+	out << "}\n";
+}
+
+int main(int argc, char** argv) {
+	Settings settings;
+	if (!parse_arguments(argc, argv, settings)) {
+		std::cout << USAGE;
+		return 1;
+	}
+
+	std::vector<ExtractionResult> extractions;
+	std::vector<ExportResult> exports;
+	std::vector<DispatchResult> dispatches;
+	for (int resolution : settings.resolutions)
+		for (const std::string& name : settings.fields) {
+			std::cout << "Benchmarking " << name << " at " << resolution << "^3" << std::endl;
+
+			// Lambdas so each field is inlined into the sampling loop, same as the real front ends
+			if (name == "f1")
+				run_field([](float x, float y, float z) { return f1(x, y, z); }, name, resolution, settings, extractions, exports, dispatches);
+			else if (name == "f2")
+				run_field([](float x, float y, float z) { return f2(x, y, z); }, name, resolution, settings, extractions, exports, dispatches);
+			else if (name == "sphere")
+				run_field([](float x, float y, float z) { return sphere(x, y, z); }, name, resolution, settings, extractions, exports, dispatches);
+			else if (name == "noise")
+				run_field([](float x, float y, float z) { return noise(x, y, z); }, name, resolution, settings, extractions, exports, dispatches);
+			else {
+				std::cout << "Unknown field: " << name << std::endl;
+				return 1;
+			}
+		}
+
+	std::ofstream report(settings.out);
+	write_report(report, extractions, exports, dispatches);
+	if (!report) {
+		std::cout << "Couldn't write the report to " << settings.out << std::endl;
+		return 1;
+	}
+	std::cout << "Wrote " << settings.out << std::endl;
+	return 0;
+}
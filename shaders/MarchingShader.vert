@@ -1,7 +1,7 @@
 #version 330 core
 
 layout (location = 0) in vec3 aPos;
-layout (location = 1) in vec3 aNormal;
+layout (location = 1) in vec3 aNormal; // Just x and y come in when packed
 
 out vec3 fragpos_view;
 out vec3 norm_view;
@@ -10,10 +10,25 @@ out vec3 lightdir_view;
 uniform mat4 mvp;
 uniform mat4 view;
 
+// Packed vertices (see pack_vertices()) have positions as 0 to 1 across the box and octahedral normals
+uniform bool packed;
+uniform vec3 packMin;
+uniform vec3 packSize;
+
+vec3 octahedral_decode(vec2 e) {
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
+
 void main() {
-	gl_Position = mvp * vec4(aPos, 1);
+	vec3 position = packMin + aPos * packSize;
+	vec3 normal = packed ? octahedral_decode(aNormal.xy) : aNormal;
+
+	gl_Position = mvp * vec4(position, 1);
 
 	// Lighting calculations (in view space)
-	fragpos_view = vec3(view * vec4(aPos, 0)); // Transform into view space.
-	norm_view = vec3(inverse(transpose(view)) * vec4(aNormal, 0)); // God I was stuck on this for a while, but w component must be 0 here, otherwise its translated.
+	fragpos_view = vec3(view * vec4(position, 0)); // Transform into view space.
+	norm_view = vec3(inverse(transpose(view)) * vec4(normal, 0)); // God I was stuck on this for a while, but w component must be 0 here, otherwise its translated.
 }
\ No newline at end of file
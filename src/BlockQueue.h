@@ -0,0 +1,105 @@
+#ifndef BLOCKQUEUE_H
+#define BLOCKQUEUE_H
+#include <atomic>
+#include <cstdint>
+#include "MarchingCubes.h"
+
+// Drawing triangles, so a block holds whole triangles only.
+const int VERTS_PER_BLOCK = 3 * 1024;
+const int INDICES_PER_BLOCK = 6 * VERTS_PER_BLOCK;
+
+// Marks a block that's part of the mesh as a whole rather than of one brick of the brick store
+const uint32_t NO_BRICK = 0xFFFFFFFF;
+
+// A fixed-size run of vertices handed from the extraction thread to the render thread. For indexed meshes the
+// block also carries the triangles that use those vertices, with indices relative to the start of the block.
+struct VertexBlock {
+	MarchingCubes::Vertex vertices[VERTS_PER_BLOCK];
+	uint32_t indices[INDICES_PER_BLOCK];
+	int count = 0;
+	int index_count = 0;
+	bool reset = false; // Throw away everything uploaded before this block, the mesh is being replaced
+	uint32_t brick = NO_BRICK; // Brick of the brick store these triangles belong to
+	bool replace = false;      // First block of a re-marched brick, throw away what was uploaded for it before
+	std::atomic<VertexBlock*> next{ nullptr };
+};
+
+// Blocks, once consumed, go back to the producer to be filled again rather than being freed, so once there are enough
+// of them going round, publishing doesn't allocate at all. Any thread can release() a block, pushing it onto a
+// lock-free stack. The producer takes the whole stack at once whenever its own list of spare blocks runs out, so it
+// never pops single blocks off the shared stack, and there's no ABA problem to worry about.
+class BlockPool {
+public:
+	// Producer only. An empty block, recycled if there's one going.
+	VertexBlock* acquire() {
+		if (spare == nullptr)
+			spare = returned.exchange(nullptr, std::memory_order_acquire);
+		if (spare == nullptr) {
+			allocated++;
+			return new VertexBlock;
+		}
+
+		VertexBlock* block = spare;
+		spare = block->next.load(std::memory_order_relaxed);
+		block->count = 0;
+		block->index_count = 0;
+		block->reset = false;
+		block->brick = NO_BRICK;
+		block->replace = false;
+		block->next.store(nullptr, std::memory_order_relaxed);
+		return block;
+	}
+
+	void release(VertexBlock* block) {
+		VertexBlock* top = returned.load(std::memory_order_relaxed);
+		do
+			block->next.store(top, std::memory_order_relaxed);
+		while (!returned.compare_exchange_weak(top, block, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	// Blocks ever allocated. Blocks are kept for good, so this is the most that were ever in use at once.
+	std::atomic<size_t> allocated{ 0 };
+
+private:
+	std::atomic<VertexBlock*> returned{ nullptr }; // Released, waiting for the producer to take them
+	VertexBlock* spare = nullptr;                  // Taken by the producer, handed out one at a time
+};
+
+// Where every block comes from and goes back to
+extern BlockPool block_pool;
+
+// Single producer/single consumer queue of vertex blocks, so extraction and rendering never wait on each other.
+// The producer fills a block privately and publishes it with one release store onto the tail's next pointer,
+// the consumer picks it up with an acquire load. The head is always the last block consumed, which keeps
+// the two sides from ever touching the same pointer.
+class BlockQueue {
+public:
+	BlockQueue() : head(new VertexBlock), tail(head) {}
+
+	// Producer only
+	void push(VertexBlock* block) {
+		block->next.store(nullptr, std::memory_order_relaxed);
+		tail->next.store(block, std::memory_order_release);
+		tail = block;
+	}
+
+	// Consumer only. The returned block stays valid until the next call to pop, which hands it back to block_pool.
+	VertexBlock* pop() {
+		VertexBlock* next = head->next.load(std::memory_order_acquire);
+		if (next == nullptr)
+			return nullptr;
+
+		block_pool.release(head);
+		head = next;
+		return next;
+	}
+
+private:
+	VertexBlock* head;
+	VertexBlock* tail;
+};
+
+// Blocks on their way from the extractor to the renderer's update()
+extern BlockQueue published;
+
+#endif
@@ -0,0 +1,195 @@
+#include "BrickPyramid.h"
+#include <algorithm>
+#include <limits>
+
+void BrickPyramid::resize(size_t x_points, size_t y_points, size_t z_points) {
+	points[0] = x_points;
+	points[1] = y_points;
+	points[2] = z_points;
+	levels.clear();
+
+	Level level;
+	for (int axis = 0; axis < 3; axis++)
+		level.size[axis] = (points[axis] - 1 + BRICK_CELLS - 1) / BRICK_CELLS;
+
+	for (;;) {
+		level.min.assign(level.count(), std::numeric_limits<float>::max());
+		level.max.assign(level.count(), std::numeric_limits<float>::lowest());
+		levels.push_back(level);
+
+		if (level.count() == 1)
+			break;
+		for (int axis = 0; axis < 3; axis++)
+			level.size[axis] = (level.size[axis] + 1) / 2;
+	}
+}
+
+void BrickPyramid::build_layer(const std::vector<std::vector<float>>& slices, size_t bk) {
+	Level& bricks = levels[0];
+	const size_t x_cells = points[0] - 1, y_cells = points[1] - 1, z_cells = points[2] - 1;
+	const size_t y_points = points[1];
+
+	// Bricks share their faces' lattice points with their neighbours, so brick b spans points b * BRICK_CELLS up
+	// to and including (b + 1) * BRICK_CELLS, and the points on a boundary go into the bricks on both sides
+	size_t k_end = std::min(z_cells, (bk + 1) * BRICK_CELLS);
+	for (size_t k = bk * BRICK_CELLS; k <= k_end; k++) {
+		const std::vector<float>& slice = slices[k];
+
+		for (size_t i = 0; i <= x_cells; i++) {
+			size_t bi_first = i / BRICK_CELLS > 0 && i % BRICK_CELLS == 0 ? i / BRICK_CELLS - 1 : i / BRICK_CELLS;
+			size_t bi_last = std::min(bricks.size[0] - 1, i / BRICK_CELLS);
+
+			for (size_t bj = 0; bj < bricks.size[1]; bj++) {
+				// Range of the row's points inside this brick
+				const float* row = &slice[i * y_points + bj * BRICK_CELLS];
+				const size_t count = std::min(y_cells, (bj + 1) * BRICK_CELLS) - bj * BRICK_CELLS + 1;
+				float lo = row[0], hi = row[0];
+				for (size_t j = 1; j < count; j++) {
+					lo = std::min(lo, row[j]);
+					hi = std::max(hi, row[j]);
+				}
+
+				for (size_t bi = bi_first; bi <= bi_last; bi++) {
+					size_t node = bricks.node(bk, bi, bj);
+					bricks.min[node] = std::min(bricks.min[node], lo);
+					bricks.max[node] = std::max(bricks.max[node], hi);
+				}
+			}
+		}
+	}
+}
+
+void BrickPyramid::build_levels() {
+	for (size_t l = 1; l < levels.size(); l++) {
+		const Level& below = levels[l - 1];
+		Level& level = levels[l];
+
+		for (size_t bk = 0; bk < below.size[2]; bk++)
+			for (size_t bi = 0; bi < below.size[0]; bi++)
+				for (size_t bj = 0; bj < below.size[1]; bj++) {
+					size_t child = below.node(bk, bi, bj);
+					size_t node = level.node(bk / 2, bi / 2, bj / 2);
+					level.min[node] = std::min(level.min[node], below.min[child]);
+					level.max[node] = std::max(level.max[node], below.max[child]);
+				}
+	}
+}
+
+void BrickPyramid::rebuild(const std::vector<std::vector<float>>& slices, const size_t first[3], const size_t last[3]) {
+	Level& bricks = levels[0];
+	const size_t y_points = points[1];
+
+	for (size_t bk = first[2]; bk <= last[2]; bk++)
+		for (size_t bi = first[0]; bi <= last[0]; bi++)
+			for (size_t bj = first[1]; bj <= last[1]; bj++) {
+				// Every lattice point of the brick, faces included
+				float lo = std::numeric_limits<float>::max(), hi = std::numeric_limits<float>::lowest();
+				for (size_t k = bk * BRICK_CELLS; k <= std::min(points[2] - 1, (bk + 1) * BRICK_CELLS); k++)
+					for (size_t i = bi * BRICK_CELLS; i <= std::min(points[0] - 1, (bi + 1) * BRICK_CELLS); i++) {
+						const float* row = &slices[k][i * y_points];
+						for (size_t j = bj * BRICK_CELLS; j <= std::min(points[1] - 1, (bj + 1) * BRICK_CELLS); j++) {
+							lo = std::min(lo, row[j]);
+							hi = std::max(hi, row[j]);
+						}
+					}
+
+				size_t node = bricks.node(bk, bi, bj);
+				bricks.min[node] = lo;
+				bricks.max[node] = hi;
+			}
+
+	// Then each level's nodes over those bricks, from their children
+	size_t lo[3] = { first[0], first[1], first[2] }, hi[3] = { last[0], last[1], last[2] };
+	for (size_t l = 1; l < levels.size(); l++) {
+		const Level& below = levels[l - 1];
+		Level& level = levels[l];
+		for (int axis = 0; axis < 3; axis++) {
+			lo[axis] /= 2;
+			hi[axis] /= 2;
+		}
+
+		for (size_t bk = lo[2]; bk <= hi[2]; bk++)
+			for (size_t bi = lo[0]; bi <= hi[0]; bi++)
+				for (size_t bj = lo[1]; bj <= hi[1]; bj++) {
+					size_t node = level.node(bk, bi, bj);
+					level.min[node] = std::numeric_limits<float>::max();
+					level.max[node] = std::numeric_limits<float>::lowest();
+
+					for (size_t ck = 2 * bk; ck < std::min(below.size[2], 2 * bk + 2); ck++)
+						for (size_t ci = 2 * bi; ci < std::min(below.size[0], 2 * bi + 2); ci++)
+							for (size_t cj = 2 * bj; cj < std::min(below.size[1], 2 * bj + 2); cj++) {
+								size_t child = below.node(ck, ci, cj);
+								level.min[node] = std::min(level.min[node], below.min[child]);
+								level.max[node] = std::max(level.max[node], below.max[child]);
+							}
+				}
+	}
+}
+
+void BrickPyramid::update_active(float isovalue, const size_t first[3], const size_t last[3], ActiveBricks& active) const {
+	const Level& bricks = levels[0];
+
+	for (size_t bk = first[2]; bk <= last[2]; bk++) {
+		for (size_t bi = first[0]; bi <= last[0]; bi++) {
+			for (size_t bj = first[1]; bj <= last[1]; bj++) {
+				size_t node = bricks.node(bk, bi, bj);
+				uint8_t flag = straddles(bricks, node, isovalue) ? 1 : 0;
+				if (flag && !active.brick[node])
+					active.count++;
+				else if (!flag && active.brick[node])
+					active.count--;
+				active.brick[node] = flag;
+			}
+
+			// Rows and layers are flagged if anything in them is, which could be outside the range
+			uint8_t row = 0;
+			for (size_t bj = 0; bj < bricks.size[1] && !row; bj++)
+				row = active.brick[bricks.node(bk, bi, bj)];
+			active.row[bk * bricks.size[0] + bi] = row;
+		}
+
+		uint8_t layer = 0;
+		for (size_t bi = 0; bi < bricks.size[0] && !layer; bi++)
+			layer = active.row[bk * bricks.size[0] + bi];
+		active.layer[bk] = layer;
+	}
+}
+
+void BrickPyramid::find_active(float isovalue, ActiveBricks& active) const {
+	if (levels.empty()) {
+		active = ActiveBricks();
+		return;
+	}
+
+	const Level& bricks = levels[0];
+	std::copy(bricks.size, bricks.size + 3, active.bricks);
+	active.count = 0;
+	active.brick.assign(bricks.count(), 0);
+	active.row.assign(bricks.size[2] * bricks.size[0], 0);
+	active.layer.assign(bricks.size[2], 0);
+
+	descend(levels.size() - 1, 0, 0, 0, isovalue, active);
+}
+
+void BrickPyramid::descend(size_t level, size_t bk, size_t bi, size_t bj, float isovalue, ActiveBricks& active) const {
+	const Level& nodes = levels[level];
+	size_t node = nodes.node(bk, bi, bj);
+
+	if (!straddles(nodes, node, isovalue))
+		return;
+
+	if (level == 0) {
+		active.brick[node] = 1;
+		active.row[bk * nodes.size[0] + bi] = 1;
+		active.layer[bk] = 1;
+		active.count++;
+		return;
+	}
+
+	// Children that hang off the far side of an odd sized level don't exist
+	const Level& below = levels[level - 1];
+	for (size_t ck = 2 * bk; ck < std::min(below.size[2], 2 * bk + 2); ck++)
+		for (size_t ci = 2 * bi; ci < std::min(below.size[0], 2 * bi + 2); ci++)
+			for (size_t cj = 2 * bj; cj < std::min(below.size[1], 2 * bj + 2); cj++)
+				descend(level - 1, ck, ci, cj, isovalue, active);
+}
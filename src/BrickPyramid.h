@@ -0,0 +1,72 @@
+#ifndef BRICKPYRAMID_H
+#define BRICKPYRAMID_H
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+// Cells along each side of a brick, the unit empty space is skipped in
+const size_t BRICK_CELLS = 8;
+
+// Bricks that can hold part of the surface at one isovalue. Indexed like the slices, z then x then y, with a flag per
+// row and per layer of bricks too so the marcher can pass over whole empty rows and layers at once.
+struct ActiveBricks {
+	size_t bricks[3] = { 0, 0, 0 }; // Along x, y and z
+	size_t count = 0;               // Number of active bricks
+	std::vector<uint8_t> brick, row, layer;
+
+	bool has_layer(size_t bk) const { return layer[bk] != 0; }
+	bool has_row(size_t bk, size_t bi) const { return row[bk * bricks[0] + bi] != 0; }
+	bool has_brick(size_t bk, size_t bi, size_t bj) const { return brick[(bk * bricks[0] + bi) * bricks[1] + bj] != 0; }
+};
+
+// Min/max pyramid over a lattice of samples. Level 0 has the range of the values at every lattice point of each brick
+// (the corners of all its cells), and every level above has the range over 2x2x2 nodes of the one below, up to a
+// single node covering the whole lattice. A cell only has triangles if some corner is below the isovalue and some
+// isn't, so a brick whose range doesn't straddle the isovalue can be skipped, and so can any node above it.
+class BrickPyramid {
+public:
+	// Sizes the pyramid for a lattice with the given number of samples along x, y and z
+	void resize(size_t x_points, size_t y_points, size_t z_points);
+
+	// Fills in level 0 for brick layer bk from the samples, slices[k][i * y_points + j] as sample_slice lays them out.
+	// Layers don't share anything, so they can be built from several threads at once.
+	void build_layer(const std::vector<std::vector<float>>& slices, size_t bk);
+
+	// Fills in the levels above 0, once every layer is built
+	void build_levels();
+
+	// Recomputes the bricks from first to last (inclusive, along x, y and z) from the samples, after some of theirs
+	// changed, and the nodes above them. Takes time in proportion to the bricks rather than the lattice.
+	void rebuild(const std::vector<std::vector<float>>& slices, const size_t first[3], const size_t last[3]);
+
+	// Refreshes active's flags for the bricks from first to last, after a rebuild() of them
+	void update_active(float isovalue, const size_t first[3], const size_t last[3], ActiveBricks& active) const;
+
+	// Walks down from the top marking the bricks whose range straddles isovalue. Only nodes that straddle it are
+	// visited, so this takes time in proportion to the surface rather than to the volume.
+	void find_active(float isovalue, ActiveBricks& active) const;
+
+	size_t layers() const { return levels.empty() ? 0 : levels[0].size[2]; }
+	size_t brick_count() const { return levels.empty() ? 0 : levels[0].count(); }
+
+private:
+	struct Level {
+		size_t size[3] = { 0, 0, 0 }; // Nodes along x, y and z
+		std::vector<float> min, max;
+
+		size_t count() const { return size[0] * size[1] * size[2]; }
+		size_t node(size_t bk, size_t bi, size_t bj) const { return (bk * size[0] + bi) * size[1] + bj; }
+	};
+
+	bool straddles(const Level& nodes, size_t node, float isovalue) const {
+		// Same test the classifier makes per corner, a corner is inside when it's below isovalue
+		return nodes.min[node] < isovalue && nodes.max[node] >= isovalue;
+	}
+
+	void descend(size_t level, size_t bk, size_t bi, size_t bj, float isovalue, ActiveBricks& active) const;
+
+	size_t points[3] = { 0, 0, 0 };
+	std::vector<Level> levels;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef CHUNKEDARRAY_H
+#define CHUNKEDARRAY_H
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <algorithm>
+
+// An array that grows CHUNK elements at a time. Nothing in it ever moves, so growing it never copies what's there
+// already the way a vector doubling does. clear() keeps the chunks to be filled again, so once an array has been as
+// big as it gets, filling it again doesn't allocate at all. Elements are only contiguous within a chunk, run() hands
+// them out a chunk's worth at a time.
+template <typename T, size_t CHUNK>
+class ChunkedArray {
+public:
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	T& operator[](size_t n) { return chunks[n / CHUNK][n % CHUNK]; }
+	const T& operator[](size_t n) const { return chunks[n / CHUNK][n % CHUNK]; }
+
+	void push_back(const T& value) {
+		if (count == chunks.size() * CHUNK)
+			chunks.emplace_back(new T[CHUNK]);
+		(*this)[count++] = value;
+	}
+
+	void append(const T* data, size_t n) {
+		size_t at = count;
+		resize(count + n);
+		for (size_t length; n > 0; data += length, at += length, n -= length) {
+			T* to = run(at, length);
+			length = std::min(length, n);
+			std::copy(data, data + length, to);
+		}
+	}
+
+	// Adds chunks until there's room for n elements. Any new elements are left for the caller to fill in.
+	void resize(size_t n) {
+		while (chunks.size() * CHUNK < n)
+			chunks.emplace_back(new T[CHUNK]);
+		count = n;
+	}
+
+	void clear() { count = 0; }
+
+	// Frees the chunks as well
+	void release() {
+		chunks.clear();
+		count = 0;
+	}
+
+	// Element first, with length set to how many follow on from it in the same chunk, up to the end of the array
+	T* run(size_t first, size_t& length) {
+		length = std::min(CHUNK - first % CHUNK, count - first);
+		return &(*this)[first];
+	}
+	const T* run(size_t first, size_t& length) const {
+		length = std::min(CHUNK - first % CHUNK, count - first);
+		return &(*this)[first];
+	}
+
+	// Calls f(data, length) on each contiguous run of the n elements from first on
+	template <typename F>
+	void for_each_run(size_t first, size_t n, F f) const {
+		for (size_t end = first + n, length; first < end; first += length) {
+			const T* data = run(first, length);
+			length = std::min(length, end - first);
+			f(data, length);
+		}
+	}
+
+private:
+	std::vector<std::unique_ptr<T[]>> chunks;
+	size_t count = 0;
+};
+
+#endif
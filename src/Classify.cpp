@@ -0,0 +1,155 @@
+#include "Classify.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CLASSIFY_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit AVX2 for functions that ask for it, MSVC emits whatever intrinsics it's given
+#if defined(CLASSIFY_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
+void classify_row_scalar(const float* left0, const float* right0, const float* left1, const float* right1,
+						 size_t count, float isovalue, uint8_t* cases) {
+	for (size_t j = 0; j < count; j++) {
+		int marching_case = 0;
+
+		if (left0[j] < isovalue)
+			marching_case |= BOT_BACK_LEFT;
+		if (right0[j] < isovalue)
+			marching_case |= BOT_BACK_RIGHT;
+		if (right1[j] < isovalue)
+			marching_case |= BOT_TOP_RIGHT;
+		if (left1[j] < isovalue)
+			marching_case |= BOT_TOP_LEFT;
+		if (left0[j + 1] < isovalue)
+			marching_case |= TOP_BACK_LEFT;
+		if (right0[j + 1] < isovalue)
+			marching_case |= TOP_BACK_RIGHT;
+		if (right1[j + 1] < isovalue)
+			marching_case |= TOP_TOP_RIGHT;
+		if (left1[j + 1] < isovalue)
+			marching_case |= TOP_TOP_LEFT;
+
+		cases[j] = (uint8_t)marching_case;
+	}
+}
+
+#ifdef CLASSIFY_X86
+
+// Both SIMD versions work on several cells side by side rather than the 8 corners of one cell: each corner is loaded
+// for 4 or 8 consecutive cells, compared against the isovalue, and its bit is ANDed out of the compare mask and ORed
+// into that lane's case. That's 8 compares for a whole vector of cells with no branches and no bit shuffling.
+
+void classify_row_sse2(const float* left0, const float* right0, const float* left1, const float* right1,
+					   size_t count, float isovalue, uint8_t* cases) {
+	const __m128 iso = _mm_set1_ps(isovalue);
+
+	size_t j = 0;
+	for (; j + 4 <= count; j += 4) {
+		__m128i c = _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(left0 + j), iso)), _mm_set1_epi32(BOT_BACK_LEFT));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(right0 + j), iso)), _mm_set1_epi32(BOT_BACK_RIGHT)));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(right1 + j), iso)), _mm_set1_epi32(BOT_TOP_RIGHT)));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(left1 + j), iso)), _mm_set1_epi32(BOT_TOP_LEFT)));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(left0 + j + 1), iso)), _mm_set1_epi32(TOP_BACK_LEFT)));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(right0 + j + 1), iso)), _mm_set1_epi32(TOP_BACK_RIGHT)));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(right1 + j + 1), iso)), _mm_set1_epi32(TOP_TOP_RIGHT)));
+		c = _mm_or_si128(c, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(left1 + j + 1), iso)), _mm_set1_epi32(TOP_TOP_LEFT)));
+
+		// 4 x int32 down to 4 bytes. Cases are at most 255, so the saturating packs don't change them.
+		__m128i packed = _mm_packus_epi16(_mm_packs_epi32(c, c), _mm_setzero_si128());
+		int bytes = _mm_cvtsi128_si32(packed);
+		for (int b = 0; b < 4; b++)
+			cases[j + b] = (uint8_t)(bytes >> (8 * b));
+	}
+
+	classify_row_scalar(left0 + j, right0 + j, left1 + j, right1 + j, count - j, isovalue, cases + j);
+}
+
+TARGET_AVX2 void classify_row_avx2(const float* left0, const float* right0, const float* left1, const float* right1,
+								   size_t count, float isovalue, uint8_t* cases) {
+	const __m256 iso = _mm256_set1_ps(isovalue);
+
+	size_t j = 0;
+	for (; j + 8 <= count; j += 8) {
+		__m256i c = _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(left0 + j), iso, _CMP_LT_OQ)), _mm256_set1_epi32(BOT_BACK_LEFT));
+		c = _mm256_or_si256(c, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(right0 + j), iso, _CMP_LT_OQ)), _mm256_set1_epi32(BOT_BACK_RIGHT)));
+		c = _mm256_or_si256(c, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(right1 + j), iso, _CMP_LT_OQ)), _mm256_set1_epi32(BOT_TOP_RIGHT)));
+		c = _mm256_or_si256(c, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(left1 + j), iso, _CMP_LT_OQ)), _mm256_set1_epi32(BOT_TOP_LEFT)));
+		c = _mm256_or_si256(c, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(left0 + j + 1), iso, _CMP_LT_OQ)), _mm256_set1_epi32(TOP_BACK_LEFT)));
+		c = _mm256_or_si256(c, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(right0 + j + 1), iso, _CMP_LT_OQ)), _mm256_set1_epi32(TOP_BACK_RIGHT)));
+		c = _mm256_or_si256(c, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(right1 + j + 1), iso, _CMP_LT_OQ)), _mm256_set1_epi32(TOP_TOP_RIGHT)));
+		c = _mm256_or_si256(c, _mm256_and_si256(_mm256_castps_si256(_mm256_cmp_ps(_mm256_loadu_ps(left1 + j + 1), iso, _CMP_LT_OQ)), _mm256_set1_epi32(TOP_TOP_LEFT)));
+
+		// 8 x int32 down to 8 bytes, same as the SSE2 version but with the two halves packed together
+		__m128i words = _mm_packs_epi32(_mm256_castsi256_si128(c), _mm256_extracti128_si256(c, 1));
+		_mm_storel_epi64((__m128i*)(cases + j), _mm_packus_epi16(words, words));
+	}
+
+	// Clear the upper halves before going back to SSE code, or every SSE instruction after this (including the
+	// field's sin and cos) pays for a false dependency on them
+	_mm256_zeroupper();
+
+	classify_row_scalar(left0 + j, right0 + j, left1 + j, right1 + j, count - j, isovalue, cases + j);
+}
+
+bool cpu_has_avx2() {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// AVX needs the OS to save the upper halves of the registers too (OSXSAVE, and XCR0's SSE and AVX state bits)
+	__cpuid(info, 1);
+	bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+
+	__cpuidex(info, 7, 0);
+	return avx && (info[1] & (1 << 5));
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool cpu_has_sse2() {
+#if defined(__x86_64__) || defined(_M_X64)
+	return true; // Part of the x86-64 baseline
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1 << 26)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#endif
+
+ClassifyRow select_classifier(bool simd) {
+#ifdef CLASSIFY_X86
+	if (simd && cpu_has_avx2())
+		return classify_row_avx2;
+	if (simd && cpu_has_sse2())
+		return classify_row_sse2;
+#endif
+	return classify_row_scalar;
+}
+
+const char* classifier_name(bool simd) {
+	ClassifyRow classifier = select_classifier(simd);
+#ifdef CLASSIFY_X86
+	if (classifier == classify_row_avx2)
+		return "AVX2";
+	if (classifier == classify_row_sse2)
+		return "SSE2";
+#endif
+	return "scalar";
+}
@@ -0,0 +1,29 @@
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+#include <cstddef>
+#include <cstdint>
+
+// Case bits, one per cube corner, set when that corner is below the isovalue
+const int BOT_BACK_LEFT =  0b00000001;
+const int BOT_BACK_RIGHT = 0b00000010;
+const int BOT_TOP_RIGHT =  0b00000100;
+const int BOT_TOP_LEFT =   0b00001000;
+const int TOP_BACK_LEFT =  0b00010000;
+const int TOP_BACK_RIGHT = 0b00100000;
+const int TOP_TOP_RIGHT =  0b01000000;
+const int TOP_TOP_LEFT =   0b10000000;
+
+// Works out the marching case of every cell along a row of y. The row of cells sits between lattice rows i and i + 1
+// of the slices at z and z + stepsize: left0/right0 are rows i and i + 1 of the lower slice, left1/right1 the same
+// rows of the upper one. Each row has count + 1 samples, and cases gets count entries.
+typedef void (*ClassifyRow)(const float* left0, const float* right0, const float* left1, const float* right1,
+							size_t count, float isovalue, uint8_t* cases);
+
+// The fastest classifier this CPU supports (AVX2, SSE2 or plain C++), or the plain one if simd is false.
+// Picked by checking the CPU at runtime, so one binary runs everywhere.
+ClassifyRow select_classifier(bool simd);
+
+// Name of the instruction set select_classifier(simd) ends up using, for reporting
+const char* classifier_name(bool simd);
+
+#endif
@@ -0,0 +1,336 @@
+// Headless front end: extracts a surface and writes it to a PLY file, no window or GL needed.
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <csignal>
+
+#include "MarchingCubes.h"
+#include "Fields.h"
+#include "Volume.h"
+
+const char* USAGE =
+	"Usage: marching_cubes_cli [options]\n"
+	"  --field NAME        f1, f2, sphere or noise (default f1)\n"
+	"  --iso VALUE         Isovalue (default 0)\n"
+	"  --min VALUE         Lower bound of the domain on every axis (default -5)\n"
+	"  --max VALUE         Upper bound of the domain on every axis (default 5)\n"
+	"  --step VALUE        Cell size (default 0.065)\n"
+	"  --resolution N      Cells along each axis, instead of giving --step\n"
+	"  --threads N         Worker threads, 0 for one per hardware thread (default 0)\n"
+	"  --out PATH          PLY file to write (default output.ply)\n"
+	"  --binary            Write binary PLY rather than ASCII\n"
+	"  --indexed           Weld shared vertices and write an indexed mesh\n"
+	"  --gradient-normals  Normals from the field's gradient rather than the faces\n"
+	"  --midpoint          Put vertices at edge midpoints instead of interpolating\n"
+	"  --error             Report how far the vertices are from the true surface\n"
+	"  --decider           Settle ambiguous faces with the asymptotic decider, for a watertight manifold mesh\n"
+	"  --check-manifold    Count the mesh's open and non-manifold edges\n"
+	"  --stream            Write the mesh out as it's extracted instead of holding it all in memory\n"
+	"  --memory-cap MB     With --stream, most finished triangles to queue up for writing (default 256)\n"
+	"  --checkpoint PATH   Save finished slabs to PATH, and resume from it if a run was killed or stopped with Ctrl-C\n"
+	"  --progress          Print how far along the extraction is every second\n"
+	"\n"
+	"Volumes, in place of --field and the bounds:\n"
+	"  --volume PATH       .nrrd/.nhdr file, or raw voxels described by the options below\n"
+	"  --dims X,Y,Z        Voxels along each axis of a raw volume\n"
+	"  --type TYPE         uint8, uint16 or float32 (default uint8)\n"
+	"  --spacing X,Y,Z     Distance between voxels (default 1,1,1)\n"
+	"  --offset N          Bytes to skip before the first voxel (default 0)\n"
+	"  --big-endian        Raw voxels are big endian\n";
+
+struct Arguments {
+	std::string field = "f1";
+	float isovalue = 0;
+	float min = -5, max = 5;
+	float stepsize = 0.065f;
+	int resolution = 0;
+	std::string out = "output.ply";
+	MarchingCubes::Options options;
+
+	std::string volume;
+	Volume::Layout layout;
+	bool have_dims = false;
+
+	bool stream = false;
+	int memory_cap = 256; // MB
+	bool check_manifold = false;
+	bool progress = false;
+};
+
+// Parses value as a number, complaining and returning false if it isn't one
+bool parse(const char* name, const char* value, float& result) {
+	char* end;
+	result = std::strtof(value, &end);
+	if (end == value || *end != '\0') {
+		std::cout << name << " expects a number, got " << value << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool parse(const char* name, const char* value, int& result) {
+	char* end;
+	long parsed = std::strtol(value, &end, 10);
+	if (end == value || *end != '\0' || parsed < 0) {
+		std::cout << name << " expects a whole number, got " << value << std::endl;
+		return false;
+	}
+	result = (int)parsed;
+	return true;
+}
+
+// Parses "X,Y,Z"
+bool parse(const char* name, const char* value, float result[3]) {
+	char* end;
+	const char* p = value;
+	for (int axis = 0; axis < 3; axis++) {
+		result[axis] = std::strtof(p, &end);
+		if (end == p || *end != (axis < 2 ? ',' : '\0')) {
+			std::cout << name << " expects X,Y,Z, got " << value << std::endl;
+			return false;
+		}
+		p = end + 1;
+	}
+	return true;
+}
+
+bool parse_arguments(int argc, char** argv, Arguments& args) {
+	for (int a = 1; a < argc; a++) {
+		std::string arg = argv[a];
+
+		// Flags
+		if (arg == "--binary")
+			args.options.ply_format = MarchingCubes::PLYFormat::Binary;
+		else if (arg == "--indexed")
+			args.options.indexed = true;
+		else if (arg == "--gradient-normals")
+			args.options.gradient_normals = true;
+		else if (arg == "--midpoint")
+			args.options.interpolate = false;
+		else if (arg == "--error")
+			args.options.measure_error = true;
+		else if (arg == "--decider")
+			args.options.asymptotic_decider = true;
+		else if (arg == "--check-manifold")
+			args.check_manifold = true;
+		else if (arg == "--progress")
+			args.progress = true;
+		else if (arg == "--stream")
+			args.stream = true;
+		else if (arg == "--big-endian")
+			args.layout.big_endian = true;
+		else if (arg == "--help" || arg == "-h")
+			return false;
+
+		// Everything else takes a value
+		else if (a + 1 >= argc) {
+			std::cout << "Unknown option or missing value: " << arg << std::endl;
+			return false;
+		}
+		else {
+			const char* value = argv[++a];
+			int threads = 0, offset = 0;
+			float triple[3];
+			bool ok = true;
+			if (arg == "--field")
+				args.field = value;
+			else if (arg == "--iso")
+				ok = parse("--iso", value, args.isovalue);
+			else if (arg == "--min")
+				ok = parse("--min", value, args.min);
+			else if (arg == "--max")
+				ok = parse("--max", value, args.max);
+			else if (arg == "--step")
+				ok = parse("--step", value, args.stepsize);
+			else if (arg == "--resolution")
+				ok = parse("--resolution", value, args.resolution);
+			else if (arg == "--threads") {
+				ok = parse("--threads", value, threads);
+				args.options.threads = threads;
+			}
+			else if (arg == "--out")
+				args.out = value;
+			else if (arg == "--checkpoint")
+				args.options.checkpoint = value;
+			else if (arg == "--memory-cap")
+				ok = parse("--memory-cap", value, args.memory_cap);
+			else if (arg == "--volume")
+				args.volume = value;
+			else if (arg == "--dims") {
+				ok = parse("--dims", value, triple);
+				for (int axis = 0; axis < 3; axis++)
+					args.layout.dims[axis] = (size_t)std::max(0.0f, triple[axis]);
+				args.have_dims = true;
+			}
+			else if (arg == "--spacing") {
+				ok = parse("--spacing", value, triple);
+				args.layout.spacing = glm::vec3(triple[0], triple[1], triple[2]);
+			}
+			else if (arg == "--offset") {
+				ok = parse("--offset", value, offset);
+				args.layout.offset = offset;
+			}
+			else if (arg == "--type") {
+				std::string type = value;
+				if (type == "uint8")
+					args.layout.type = Volume::Type::UInt8;
+				else if (type == "uint16")
+					args.layout.type = Volume::Type::UInt16;
+				else if (type == "float32")
+					args.layout.type = Volume::Type::Float32;
+				else {
+					std::cout << "--type expects uint8, uint16 or float32, got " << type << std::endl;
+					ok = false;
+				}
+			}
+			else {
+				std::cout << "Unknown option: " << arg << std::endl;
+				return false;
+			}
+			if (!ok)
+				return false;
+		}
+	}
+
+	if (args.resolution > 0)
+		args.stepsize = (args.max - args.min) / args.resolution;
+	if (!(args.stepsize > 0) || !(args.max > args.min)) {
+		std::cout << "Need max > min and a positive step" << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool ends_with(const std::string& text, const std::string& suffix) {
+	return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Counts the edges that would need repairing, once the mesh is saved
+void report_manifold(const MarchingCubes::Lattice& lattice, const Arguments& args) {
+	if (!args.check_manifold)
+		return;
+	if (args.stream) {
+		std::cout << "A streamed mesh isn't kept in memory, so it can't be checked" << std::endl;
+		return;
+	}
+
+	MarchingCubes::ManifoldReport report = MarchingCubes::check_manifold(lattice);
+	std::cout << "Edges: " << report.edges << ", " << report.boundary_edges << " open, " << report.non_manifold_edges
+		<< " non-manifold, " << report.degenerate_edges << " degenerate, " << report.domain_edges
+		<< " open along the sides of the domain" << std::endl;
+}
+
+// The extraction, for Ctrl-C to cancel rather than kill the program, so the checkpoint and a streamed file are left whole
+MarchingCubes::Job job;
+
+void interrupt(int) {
+	job.cancel();
+}
+
+// Runs extract with the job watching it, printing how far along it is every second with --progress. Returns false if
+// it was cancelled, leaving only part of the surface, which isn't worth saving.
+template <typename Extract>
+bool run_job(Arguments& args, Extract extract) {
+	args.options.job = &job;
+	std::signal(SIGINT, interrupt);
+
+	std::thread progress;
+	if (args.progress)
+		progress = std::thread([]() {
+			auto next = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+			while (!job.finished) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(50));
+				if (std::chrono::steady_clock::now() < next)
+					continue;
+				next += std::chrono::seconds(1);
+
+				double eta = job.eta();
+				std::cout << "Progress: " << (int)(100 * job.progress()) << "% of cells, " << job.triangles << " triangles, "
+					<< (eta < 0 ? std::string("?") : std::to_string((int)eta)) << "s left" << std::endl;
+			}
+		});
+
+	bool cancelled = extract().cancelled;
+	if (progress.joinable())
+		progress.join();
+	std::signal(SIGINT, SIG_DFL);
+
+	if (cancelled && !args.options.checkpoint.empty())
+		std::cout << "Stopped, run again with the same options to carry on from " << args.options.checkpoint << std::endl;
+	else if (cancelled)
+		std::cout << "Stopped" << std::endl;
+	return !cancelled;
+}
+
+int run_volume(Arguments& args) {
+	Volume volume;
+	bool nrrd = ends_with(args.volume, ".nrrd") || ends_with(args.volume, ".nhdr");
+	if (!nrrd && !args.have_dims) {
+		std::cout << "Raw volumes need --dims, and --type unless they're uint8" << std::endl;
+		return 1;
+	}
+	if (!(nrrd ? volume.open_nrrd(args.volume) : volume.open_raw(args.volume, args.layout)))
+		return 1;
+
+	// There's nothing to compare against but the voxels themselves
+	if (args.options.measure_error) {
+		std::cout << "--error needs an analytic field, ignoring it for a volume" << std::endl;
+		args.options.measure_error = false;
+	}
+
+	if (!run_job(args, [&]() {
+		return MarchingCubes::extract_slices(volume.sampler(), args.isovalue, volume.lattice(), args.options);
+	}))
+		return 1;
+	if (!MarchingCubes::save(nullptr, args.isovalue, volume.layout().spacing.x, args.options, args.out))
+		return 1;
+	report_manifold(volume.lattice(), args);
+	return 0;
+}
+
+template <typename Field>
+int run(const Field& field, Arguments& args) {
+	if (!run_job(args, [&]() {
+		return MarchingCubes::extract(field, args.isovalue, args.min, args.max, args.stepsize, args.options);
+	}))
+		return 1;
+	if (!MarchingCubes::save(field, args.isovalue, args.stepsize, args.options, args.out))
+		return 1;
+	report_manifold(MarchingCubes::Lattice(args.min, args.max, args.stepsize), args);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	Arguments args;
+	if (!parse_arguments(argc, argv, args)) {
+		std::cout << USAGE;
+		return 1;
+	}
+
+	// Nothing is drawing the mesh, so don't queue it up for a renderer
+	args.options.publish = false;
+
+	if (args.stream) {
+		args.options.stream_to = args.out;
+		args.options.memory_cap = (size_t)args.memory_cap << 20;
+	}
+
+	if (!args.volume.empty())
+		return run_volume(args);
+
+	// Each field goes in as its own lambda so it's inlined into the sampling loop
+	if (args.field == "f1")
+		return run([](float x, float y, float z) { return f1(x, y, z); }, args);
+	if (args.field == "f2")
+		return run([](float x, float y, float z) { return f2(x, y, z); }, args);
+	if (args.field == "sphere")
+		return run([](float x, float y, float z) { return sphere(x, y, z); }, args);
+	if (args.field == "noise")
+		return run([](float x, float y, float z) { return noise(x, y, z); }, args);
+
+	std::cout << "Unknown field: " << args.field << "\n" << USAGE;
+	return 1;
+}
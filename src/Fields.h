@@ -0,0 +1,51 @@
+#ifndef FIELDS_H
+#define FIELDS_H
+#include <cmath>
+#include <cstdint>
+
+// Scalar fields to extract surfaces from, shared by the viewer and the command line tool
+
+inline float f1(float x, float y, float z) {
+	return 0.25f*y - sin(x)*cos(z);
+}
+
+inline float f2(float x, float y, float z) {
+	return sin(x) * cos(y) * sin(z);
+}
+
+// Distance from a sphere of radius 3.3, so exact as a distance field too
+inline float sphere(float x, float y, float z) {
+	return std::sqrt(x*x + y*y + z*z) - 3.3f;
+}
+
+// Pseudo-random value in [-1, 1] for a lattice point
+inline float lattice_hash(int x, int y, int z) {
+	uint32_t h = (uint32_t)x * 374761393u + (uint32_t)y * 668265263u + (uint32_t)z * 2246822519u;
+	h = (h ^ (h >> 13)) * 1274126177u;
+	h ^= h >> 16;
+	return h * (2.0f / 4294967295.0f) - 1.0f;
+}
+
+// Value noise: random values on the integer lattice, blended smoothly in between
+inline float value_noise(float x, float y, float z) {
+	float fx = std::floor(x), fy = std::floor(y), fz = std::floor(z);
+	int ix = (int)fx, iy = (int)fy, iz = (int)fz;
+	float tx = x - fx, ty = y - fy, tz = z - fz;
+	tx = tx * tx * (3 - 2 * tx);
+	ty = ty * ty * (3 - 2 * ty);
+	tz = tz * tz * (3 - 2 * tz);
+
+	auto lerp = [](float a, float b, float t) { return a + (b - a) * t; };
+	float x00 = lerp(lattice_hash(ix, iy, iz), lattice_hash(ix + 1, iy, iz), tx);
+	float x10 = lerp(lattice_hash(ix, iy + 1, iz), lattice_hash(ix + 1, iy + 1, iz), tx);
+	float x01 = lerp(lattice_hash(ix, iy, iz + 1), lattice_hash(ix + 1, iy, iz + 1), tx);
+	float x11 = lerp(lattice_hash(ix, iy + 1, iz + 1), lattice_hash(ix + 1, iy + 1, iz + 1), tx);
+	return lerp(lerp(x00, x10, ty), lerp(x01, x11, ty), tz);
+}
+
+// Three octaves of value noise, a lumpy surface with lots of small pieces to stress the extractor
+inline float noise(float x, float y, float z) {
+	return value_noise(x, y, z) + 0.5f * value_noise(2 * x, 2 * y, 2 * z) + 0.25f * value_noise(4 * x, 4 * y, 4 * z);
+}
+
+#endif
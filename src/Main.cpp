@@ -8,25 +8,20 @@
 #include <map>
 #include <functional>
 #include <thread>
+#include <string>
 
 #include "ShaderProgram.h"
 #include "BoundingBox.h"
 #include "Camera.h"
 #include "MarchingCubes.h"
+#include "MeshRenderer.h"
+#include "Fields.h"
 
 const int width = 1400, height = 1400;
 const float min = -5, max = 5;
 
 Camera camera(45, 45, 20, glm::vec3{ 0, 0, 0 });
 
-float f1(float x, float y, float z) {
-	return 0.25f*y - sin(x)*cos(z);
-}
-
-float f2(float x, float y, float z) {
-	return sin(x) * cos(y) * sin(z);
-}
-
 std::map<int, bool> keys;  // maps keycode to pressed status
 
 void mouse_cursor_callback(GLFWwindow* window, double xpos, double ypos) {
@@ -78,7 +73,17 @@ int main() {
 	ShaderProgram marching_shader("shaders/MarchingShader.vert", "shaders/MarchingShader.frag");
 	BoundingBox boundingBox(min, max);
 
-	std::thread t{ MarchingCubes::init, f1, 0, min, max, 0.065f};
+	// Everything's inside the bounding box, so positions can be packed relative to it
+	MarchingCubes::pack_vertices(glm::vec3(min), glm::vec3(max));
+
+	// The job shows how far along the extraction is, and stops it if the window's closed first
+	MarchingCubes::Job job;
+	MarchingCubes::Options options;
+	options.gradient_normals = true;
+	options.job = &job;
+	// f1 goes in through a lambda so it's inlined into the sampling loop rather than called through a pointer
+	auto field = [](float x, float y, float z) { return f1(x, y, z); };
+	std::thread t{ [=]() { MarchingCubes::init(field, 0, min, max, 0.065f, options); } };
 
 	glm::mat4 proj = glm::perspective(45.0f, (float)width / height, 0.05f, 100.0f);
 	glm::vec3 lightDir{ -1, -1, -1 };
@@ -86,6 +91,10 @@ int main() {
 	double current = glfwGetTime();
 	double last = glfwGetTime();
 	double delta = 0;
+
+	// Upload cost, averaged over about a second and shown in the title
+	double upload_ms = 0, stats_since = current;
+	int stats_frames = 0;
 	while (!glfwWindowShouldClose(window)) {
 		glfwPollEvents();
 		glClearColor(0.08f, 0.09f, 0.11f, 1);
@@ -99,6 +108,20 @@ int main() {
 		camera.update(delta);
 		MarchingCubes::update();
 
+		upload_ms += MarchingCubes::upload_stats().milliseconds;
+		stats_frames++;
+		if (current - stats_since >= 1) {
+			std::string title = "Marching cubes - upload " + std::to_string(upload_ms / stats_frames) + " ms/frame"
+				+ (MarchingCubes::upload_stats().persistent ? " (persistent)" : " (mapped)")
+				+ ", " + std::to_string(MarchingCubes::render_stats().draw_calls) + " draw calls";
+			if (!job.finished)
+				title += ", extracting " + std::to_string((int)(100 * job.progress())) + "%";
+			glfwSetWindowTitle(window, title.c_str());
+			upload_ms = 0;
+			stats_frames = 0;
+			stats_since = current;
+		}
+
 		// Update the lighting shader's view matrix and light direction
 		glUseProgram(marching_shader.ID);
 		marching_shader.setUniformMatrix4fv("view", camera.getViewMatrix());
@@ -113,7 +136,10 @@ int main() {
 		glfwSwapBuffers(window);
 	}
 
-	t.detach();
+	// Stop the extraction and wait for it, rather than leave it running while everything's torn down
+	job.cancel();
+	t.join();
+	MarchingCubes::shutdown();
 	glfwTerminate();
 	return 1;
 }
\ No newline at end of file
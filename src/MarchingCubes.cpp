@@ -1,32 +1,36 @@
 #include "MarchingCubes.h"
 #include "TriTable.hpp"
+#include "Classify.h"
+#include "BrickPyramid.h"
+#include "BlockQueue.h"
+#include "Topology.h"
 #include <iostream>
 #include <fstream>
+#include <glm/glm.hpp>
 #include <glm/gtx/string_cast.hpp>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
 #include <string>
+#include <memory>
+#include <cstring>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <array>
+#include <filesystem>
 
 typedef MarchingCubes::Vertex Vertex;
 
-struct BufferIdentifiers {
-	GLuint VAO, VBO;
-	int vert_count = 0;
-};
-
-glm::vec3 MarchingCubes::base_color = glm::vec3(0, 1, 1);  // Color of the triangles drawn
-
-// Drawing triangles, so each buffer batch must have a multiple of 3 vertices. PUNISHMENT WILL COMMENCE IF THIS ISN'T OBLIGED!
-const int VERTS_PER_BATCH = 30000;
-const size_t BYTES_PER_BATCH = VERTS_PER_BATCH * sizeof(Vertex);
-size_t buffer_bytes_occupied = 0;
-int lastIndex = 0;
-std::mutex mutex;
-
-std::vector<BufferIdentifiers> buffers; // Groups of VAO and VBO 'batches'
-std::vector<Vertex> vertices;
+typedef ChunkedArray<uint32_t, 3 << 16> IndexChunks; // Whole triangles to a chunk, like VertexChunks
 
-const int LUT_COLUMN_COUNT = 16; // 16 Indexes we could look up in TriTable.hpp
+MarchingCubes::VertexChunks vertices; // Only touched by the extraction thread
+IndexChunks indices; // Triangles of an indexed mesh, empty when every 3 vertices make a triangle
+BlockPool block_pool;          // Blocks for published to carry, recycled once the render thread's done with them
+BlockQueue published;          // Vertices on their way to the render thread
 
 // Computes the normal given 3 vertices, assuming a CCW winding order
 glm::vec3 compute_normal(const Vertex& v1, const Vertex& v2,
@@ -36,141 +40,675 @@ glm::vec3 compute_normal(const Vertex& v1, const Vertex& v2,
 	glm::vec3 vec13(v3.position - v1.position);
 
 	// vec12 x vec13 will give us a a normal positive in CCW order. Make sure its a unit vector.
-	return glm::normalize(glm::cross(vec12, vec13));
+	// Interpolated vertices can land on the same corner though, and then there's no area to take a normal of.
+	glm::vec3 normal = glm::cross(vec12, vec13);
+	float length = glm::length(normal);
+	return length > 0 ? normal / length : normal;
 }
 
-// Create an empty buffer and VAO of a specified size and return those IDS
-BufferIdentifiers createEmptyBuffers(int bufferSize) {
-	GLuint VAO, VBO;
-	glGenVertexArrays(1, &VAO);
-	glBindVertexArray(VAO);
+// Slabs handed out per worker thread, more slabs means better balancing on uneven surfaces but more resampled slices
+const size_t SLABS_PER_THREAD = 4;
+
+// Marks an edge slot in the weld cache that has no vertex on it yet
+const uint32_t NO_VERTEX = 0xFFFFFFFF;
+
+const int AXIS_Z = 2;
+
+// Closest a crossing gets to either end of its edge, as a fraction of the edge
+const float CORNER_GAP = 1e-3f;
 
-	glGenBuffers(1, &VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
+// How far along an edge (0 to 1, from its lower end) the surface crosses it. With interpolate, that's where the
+// line between the two corner values crosses isovalue, otherwise it's the edge's midpoint.
+float edge_crossing(const CubeEdge& edge, const float corners[8], float isovalue, bool interpolate) {
+	if (!interpolate)
+		return 0.5f;
 
-	// data must be nullptr since its empty for now.
-	glBufferData(GL_ARRAY_BUFFER, bufferSize, nullptr, GL_STREAM_DRAW);
+	// One corner is below isovalue and the other isn't, so the two values can't be equal. A corner equal to isovalue
+	// counts as above it, same as in the classification, and the crossing would land right on it. So would one a
+	// hair's breadth from it. Every crossed edge from that corner would then put its vertex at the same point, and
+	// the triangles between them collapse, so crossings are kept just off the corners.
+	float a = corners[edge.corners[0]];
+	float b = corners[edge.corners[1]];
+	return std::min(std::max((isovalue - a) / (b - a), CORNER_GAP), 1 - CORNER_GAP);
+}
 
-	// Position
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-	glEnableVertexAttribArray(0);
+// Places the vertex t along an edge of the cell whose lowest corner is lattice point (i, j, k). It's measured
+// from the edge's lower lattice point, so every cell sharing the edge computes the exact same position.
+glm::vec3 edge_vertex(const CubeEdge& edge, float t, const MarchingCubes::Lattice& lattice, size_t i, size_t j, size_t k) {
+	glm::vec3 position(lattice.coord(0, i + edge.offset[0]), lattice.coord(1, j + edge.offset[1]),
+					   lattice.coord(2, k + edge.offset[2]));
+	position[edge.axis] += lattice.stepsize[edge.axis] * t;
+	return position;
+}
 
-	// Normal
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Vertex::normal));
-	glEnableVertexAttribArray(1);
+// The four z-slices around a layer of cells, at k - 1, k, k + 1 and k + 2. The outer two are null past the domain.
+typedef const std::vector<float>* SliceWindow[4];
 
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
+// Gradient of the field at lattice point (i, j) on the layer's lower (plane 0) or upper (plane 1) slice, by central
+// differences over the cached samples, or one-sided ones at the edges of the domain. It only gets used for its
+// direction, so it's in units of the x step, which leaves lattices with the same step on every axis exact.
+glm::vec3 lattice_gradient(const SliceWindow& window, const MarchingCubes::Lattice& lattice, size_t i, size_t j, int plane) {
+	const std::vector<float>& at = *window[plane + 1];
+	const std::vector<float>* below = window[plane];
+	const std::vector<float>* above = window[plane + 2];
 
-	buffer_bytes_occupied = 0; // New empty buffer, so 0 bytes occupied
+	const size_t x_points = lattice.points(0), y_points = lattice.points(1);
+	size_t i0 = i > 0 ? i - 1 : i, i1 = i + 1 < x_points ? i + 1 : i;
+	size_t j0 = j > 0 ? j - 1 : j, j1 = j + 1 < y_points ? j + 1 : j;
+	size_t n = i * y_points + j;
 
-	return BufferIdentifiers{ VAO, VBO };
+	glm::vec3 gradient;
+	gradient.x = (at[i1 * y_points + j] - at[i0 * y_points + j]) / (float)(i1 - i0);
+	gradient.y = (at[i * y_points + j1] - at[i * y_points + j0]) / (float)(j1 - j0);
+	gradient.z = ((above ? *above : at)[n] - (below ? *below : at)[n]) / (float)((above ? 1 : 0) + (below ? 1 : 0));
+	return gradient / (lattice.stepsize / lattice.stepsize.x);
 }
 
-// BIT MASKS
-const int BOT_BACK_LEFT =  0b00000001;
-const int BOT_BACK_RIGHT = 0b00000010;
-const int BOT_TOP_RIGHT =  0b00000100;
-const int BOT_TOP_LEFT =   0b00001000;
-const int TOP_BACK_LEFT =  0b00010000;
-const int TOP_BACK_RIGHT = 0b00100000;
-const int TOP_TOP_RIGHT =  0b01000000;
-const int TOP_TOP_LEFT =   0b10000000;
+// Normal of the vertex t along an edge of the cell at (i, j), blending the gradients at the edge's two ends the
+// same way the position is blended. Points out of the surface, towards increasing values, like the face normals do.
+glm::vec3 edge_normal(const CubeEdge& edge, float t, const SliceWindow& window, const MarchingCubes::Lattice& lattice,
+					  size_t i, size_t j) {
+	size_t a_i = i + edge.offset[0], a_j = j + edge.offset[1];
+	int a_plane = edge.offset[2];
+	glm::vec3 a = lattice_gradient(window, lattice, a_i, a_j, a_plane);
+	glm::vec3 b = lattice_gradient(window, lattice, a_i + (edge.axis == 0), a_j + (edge.axis == 1), a_plane + (edge.axis == 2));
 
-// Populates a vector passed in as an argument.
-void marching_cubes(std::function<float(float, float, float)> f, float isovalue,
-					float min, float max, float stepsize) {
+	glm::vec3 normal = a + (b - a) * t;
+	float length = glm::length(normal);
+	return length > 0 ? normal / length : normal;
+}
 
-	int byte_offset = 0; // Used for tracking our offset in glBufferSubData
+// What a slab produces. For indexed meshes, the vertex ids on the slab's first and last z-planes are kept
+// so that the vertices along the seam can be welded to the neighbouring slab's when they're merged.
+struct SlabMesh : MarchingCubes::Mesh {
+	std::vector<uint32_t> bottom_plane, top_plane;
+};
+
+// Sample cache. Every lattice point is shared by up to 8 cells, so rather than evaluating f at each cell corner
+// we evaluate it once per point into a z-slice, and cells read their corners out of the two slices they sit between.
+std::atomic<size_t> field_evals{ 0 };
+
+// Evaluates the field at every (x, y) lattice point of z-plane k. Slices are x-major, so a row of y values is contiguous.
+void sample_slice(const MarchingCubes::SliceSampler& sampler, const MarchingCubes::Lattice& lattice,
+				  size_t k, std::vector<float>& slice) {
+	sampler(lattice, k, slice);
+	field_evals += lattice.points(0) * lattice.points(1);
+}
+
+// Every slice of the lattice, kept by cache_slices() so the surface can be extracted at any isovalue without going
+// back to the field. The pyramid over it finds the bricks the surface passes through, which is all march_slab visits.
+struct SampleGrid {
+	MarchingCubes::Lattice lattice;
+	std::vector<std::vector<float>> slices; // slices[k] is z-plane k
+	BrickPyramid pyramid;
+	ActiveBricks active; // For the isovalue being extracted
+
+	// What the slices were sampled from, for resampling them after an edit
+	MarchingCubes::SliceSampler sampler;
+	std::function<float(float, float, float)> field; // Can be empty
+};
+
+SampleGrid grid;
+
+// Triangles of every brick of the cached grid, kept apart so invalidate() can redo just the bricks an edit touched
+struct BrickStore {
+	std::vector<MarchingCubes::Mesh> bricks; // Indexed like the pyramid's bricks
+	float isovalue = 0;
+	MarchingCubes::Options options;
+	MarchingCubes::LOD lod;
+	std::vector<uint8_t> levels; // Level of detail each brick is marched at
+	bool active = false;   // Filled in by extract_bricks(), and the mesh is made of it
+	bool gathered = false; // The global mesh is up to date with it
+};
+
+BrickStore store;
+
+// Rebuilds the global mesh out of the brick store, for when something needs it whole
+void gather_bricks() {
+	if (!store.active || store.gathered)
+		return;
+
+	vertices.clear();
+	indices.clear();
+	for (const MarchingCubes::Mesh& brick : store.bricks) {
+		uint32_t base = (uint32_t)vertices.size();
+		vertices.append(brick.vertices.data(), brick.vertices.size());
+		for (uint32_t id : brick.indices)
+			indices.push_back(base + id);
+	}
+	store.gathered = true;
+}
+
+// Stops tracking the brick store, leaving its triangles in the mesh, before something else changes the mesh or grid
+void settle_bricks() {
+	gather_bricks();
+	store = BrickStore();
+}
+
+// Cells [begin, end) along x, y and z
+struct CellBox {
+	size_t begin[3];
+	size_t end[3];
+};
+
+// Buffers march_slab() works in. Every thread keeps its own from one box to the next, so a worker only allocates them
+// for its first slab or brick and after that just refills them.
+struct SlabScratch {
+	std::vector<float> below, slice0, slice1, above;
+	std::vector<uint32_t> plane0, plane1, z_edges;
+	std::vector<glm::vec3> upper_normals;
+	std::vector<uint8_t> row_cases;
+};
+
+// Marches every cell in box, appending its triangles to out. Boxes are whole z-slabs of the lattice, except for
+// single bricks out of a cached grid. A box only touches its own slices and output, so any number can run at once.
+// Given a cached grid, the slices are read from that instead of sampled, and only its active bricks are marched.
+// Given emit, a triangle list goes straight into it from vertex emit_at on instead of into out, and emit has to have
+// room for all of it.
+void march_slab(const MarchingCubes::SliceSampler& f, float isovalue, const MarchingCubes::Lattice& lattice,
+				const CellBox& box, const MarchingCubes::Options& options, SlabMesh& out,
+				const SampleGrid* cached = nullptr, MarchingCubes::VertexChunks* emit = nullptr, size_t emit_at = 0) {
+
+	const bool indexed = options.indexed;
+	const bool gradient_normals = options.gradient_normals;
+
+	const size_t i_begin = box.begin[0], j_first = box.begin[1], k_begin = box.begin[2];
+	const size_t i_end = box.end[0], j_stop = box.end[1], k_end = box.end[2];
+	const size_t y_points = lattice.points(1), z_points = lattice.points(2);
+	const size_t slice_size = lattice.points(0) * y_points;
+
+	// The weld cache only covers the box's own lattice points
+	const size_t box_y_points = j_stop - j_first + 1;
+	const size_t box_plane = (i_end - i_begin + 1) * box_y_points;
+
+	// Only the slice at z and the slice at z + stepsize are needed at once, so swap them as we go up.
+	// Gradient normals also need the slices either side of those two for their central differences.
+	thread_local SlabScratch scratch;
+	std::vector<float>& below = scratch.below, & slice0 = scratch.slice0, & slice1 = scratch.slice1, & above = scratch.above;
+	if (!cached) {
+		slice0.resize(slice_size);
+		slice1.resize(slice_size);
+		sample_slice(f, lattice, k_begin, slice0);
+	}
+	if (gradient_normals && !cached) {
+		below.resize(slice_size);
+		above.resize(slice_size);
+		if (k_begin > 0)
+			sample_slice(f, lattice, k_begin - 1, below);
+	}
+
+	// Weld cache for indexed meshes, same idea as the sample slices: the vertex id on every x and y edge of the
+	// planes below and above the current layer (two per lattice point), plus the z edges running between them.
+	std::vector<uint32_t>& plane0 = scratch.plane0, & plane1 = scratch.plane1, & z_edges = scratch.z_edges;
+	if (indexed) {
+		plane0.assign(box_plane * 2, NO_VERTEX);
+		plane1.assign(box_plane * 2, NO_VERTEX);
+		z_edges.assign(box_plane, NO_VERTEX);
+	}
+
+	// A vertex on the plane below the current layer has the faces of the layer below summed already. This layer's are
+	// summed on their own here and added on after it, which is how they add up when the plane is the seam between
+	// two slabs too, so summed normals come out the same to the bit wherever the slabs are cut.
+	const bool sum_normals = indexed && !gradient_normals;
+	std::vector<glm::vec3>& upper_normals = scratch.upper_normals;
+	if (sum_normals)
+		upper_normals.assign(box_plane * 2, glm::vec3(0, 0, 0));
+	bool upper_summed = false;
+
+	// Cells are classified a whole row at a time, picking the SIMD version for this CPU once
+	static const ClassifyRow classify_row = select_classifier(true);
+	ClassifyRow classify = options.simd ? classify_row : select_classifier(false);
+	std::vector<uint8_t>& row_cases = scratch.row_cases;
+	row_cases.resize(lattice.cells[1]);
+
+	// Rows are marched a brick at a time when skipping empty bricks, and all in one go otherwise
+	const ActiveBricks* active = cached ? &cached->active : nullptr;
+	const size_t span = active ? BRICK_CELLS : j_stop - j_first;
+	bool last_layer_wrote = false;
 
 	// Vertices come in pairs of 3 in the LUT, so we'll do this on a triangle-basis.
 	// bot denotes bottom face, top denotes top face (of a cube)
 	float bot_bl, bot_br, bot_tr, bot_tl, top_bl, top_br, top_tr, top_tl;
 	int marching_case = 0;
-	for (float z = min; z < max; z += stepsize)
-		for (float x = min; x < max; x += stepsize)
-			for (float y = min; y < max; y += stepsize) {
-				// Run all vertices of cube through our function, and they have to be less than the isoval
-				bot_bl = f(x, y, z);
-				bot_br = f(x + stepsize, y, z);
-				bot_tr = f(x + stepsize, y, z + stepsize);
-				bot_tl = f(x, y, z + stepsize);
-				top_bl = f(x, y + stepsize, z);
-				top_br = f(x + stepsize, y + stepsize, z);
-				top_tr = f(x + stepsize, y + stepsize, z + stepsize);
-				top_tl = f(x, y + stepsize, z + stepsize);
-
-				marching_case = 0;
-
-				if (bot_bl < isovalue)
-					marching_case |= BOT_BACK_LEFT;
-				if (bot_br < isovalue)
-					marching_case |= BOT_BACK_RIGHT;
-				if (bot_tr < isovalue)
-					marching_case |= BOT_TOP_RIGHT;
-				if (bot_tl < isovalue)
-					marching_case |= BOT_TOP_LEFT;
-				if (top_bl < isovalue)
-					marching_case |= TOP_BACK_LEFT;
-				if (top_br < isovalue)
-					marching_case |= TOP_BACK_RIGHT;
-				if (top_tr < isovalue)
-					marching_case |= TOP_TOP_RIGHT;
-				if (top_tl < isovalue)
-					marching_case |= TOP_TOP_LEFT;
-
-				// Use the case in the LUT
-				int* lut_indices = marching_cubes_lut[marching_case];
-
-				// All entries are 3 vertices at a time to define one triangle, so skip through list in threes
-				for (int i = 0; i < LUT_COLUMN_COUNT; i += 3) {
-
-					if (lut_indices[i] < 0)
-						break; // Once we hit a -1, we're done with this centry.
-
-					// Vert table 0th index is x, 1st index is y, 2nd index is z.
-					// Also scale each by stepsize, in addition yo offsetting yb x,y,z
-					Vertex vert1({ x + stepsize * vertTable[lut_indices[i]][0],
-								   y + stepsize * vertTable[lut_indices[i]][1],
-								   z + stepsize * vertTable[lut_indices[i]][2] },
-								   { 0, 0, 0 });
-					Vertex vert2({ x + stepsize * vertTable[lut_indices[i + 1]][0],
-								   y + stepsize * vertTable[lut_indices[i + 1]][1],
-								   z + stepsize * vertTable[lut_indices[i + 1]][2] },
-								   { 0, 0, 0 });
-					Vertex vert3({x + stepsize * vertTable[lut_indices[i + 2]][0],
-								  y + stepsize * vertTable[lut_indices[i + 2]][1],
-								  z + stepsize * vertTable[lut_indices[i + 2]][2] },
-								  { 0, 0, 0 });
-
-					// Calculate normals here, and all 3 vertices share the same normal.
-					glm::vec3 norm = compute_normal(vert1, vert2, vert3);
-					vert1.normal = norm;
-					vert2.normal = norm;
-					vert3.normal = norm;
-
-					// Now add vertices to list (critical section)
-					std::lock_guard<std::mutex> lock(mutex);
-					vertices.emplace_back(vert1);
-					vertices.emplace_back(vert2);
-					vertices.emplace_back(vert3);
+	uint8_t resolved_edges[3 * MAX_RESOLVED_TRIANGLES];
+	uint16_t centres[MAX_CENTRES];
+	uint32_t centre_slots[MAX_CENTRES];
+	Vertex* emit_to = nullptr;
+	size_t emit_room = 0; // Left in emit's chunk from emit_to on
+	for (size_t k = k_begin; k < k_end; k++) {
+		// With gradient normals this slice was already sampled as the one above the last layer
+		if (!cached && (!gradient_normals || k == k_begin))
+			sample_slice(f, lattice, k + 1, slice1);
+		if (!cached && gradient_normals && k + 2 < z_points)
+			sample_slice(f, lattice, k + 2, above);
+
+		SliceWindow window = {
+			k == 0 ? nullptr : cached ? &cached->slices[k - 1] : &below,
+			cached ? &cached->slices[k] : &slice0,
+			cached ? &cached->slices[k + 1] : &slice1,
+			k + 2 >= z_points ? nullptr : cached ? &cached->slices[k + 2] : &above };
+		const std::vector<float>& lower = *window[1];
+		const std::vector<float>& upper = *window[2];
+
+		const size_t bk = k / BRICK_CELLS;
+		const size_t layer_start = out.vertices.size();
+
+		for (size_t i = i_begin; i < i_end && (!active || active->has_layer(bk)); i++) {
+			if (active && !active->has_row(bk, i / BRICK_CELLS))
+				continue;
+
+			for (size_t j_begin = j_first; j_begin < j_stop; j_begin += span) {
+				if (active && !active->has_brick(bk, i / BRICK_CELLS, j_begin / BRICK_CELLS))
+					continue;
+				const size_t j_end = std::min(j_stop, j_begin + span);
+
+				// Every vertex of a cube has to be less than the isoval to be inside, so classify the row's cells first
+				classify(&lower[i * y_points + j_begin], &lower[(i + 1) * y_points + j_begin], &upper[i * y_points + j_begin],
+						 &upper[(i + 1) * y_points + j_begin], j_end - j_begin, isovalue, &row_cases[j_begin]);
+
+				for (size_t j = j_begin; j < j_end; j++) {
+					// Cells entirely inside or outside have no triangles, which is most of them
+					marching_case = row_cases[j];
+					if (marching_case == 0 || marching_case == 255)
+						continue;
+
+					// Look up all vertices of the cube in the cache
+					size_t left = i * y_points + j;         // (i, j)
+					size_t right = (i + 1) * y_points + j;  // (i + 1, j)
+					bot_bl = lower[left];
+					bot_br = lower[right];
+					bot_tr = upper[right];
+					bot_tl = upper[left];
+					top_bl = lower[left + 1];
+					top_br = lower[right + 1];
+					top_tr = upper[right + 1];
+					top_tl = upper[left + 1];
+
+					// Corner values in the order of the case bits, for placing vertices along the edges
+					const float corners[8] = { bot_bl, bot_br, bot_tr, bot_tl, top_bl, top_br, top_tr, top_tl };
+
+					// Use the case in the LUT, whose edges come off the bottom of the word a nibble at a time, unless it has
+					// an ambiguous face for the decider to settle
+					uint64_t lut_edges = packed_lut.edges[marching_case];
+					int triangles = packed_lut.triangles(marching_case);
+					const uint8_t* resolved = nullptr;
+					if (options.asymptotic_decider && has_ambiguous_face(marching_case)) {
+						triangles = resolve_cell(corners, isovalue, marching_case, resolved_edges, centres);
+						resolved = resolved_edges;
+						std::fill(centre_slots, centre_slots + MAX_CENTRES, NO_VERTEX);
+					}
+
+					auto edge_vert = [&](int e) {
+						const CubeEdge& edge = edgeTable[e];
+						float crossing = edge_crossing(edge, corners, isovalue, options.interpolate);
+						return Vertex(edge_vertex(edge, crossing, lattice, i, j, k),
+							gradient_normals ? edge_normal(edge, crossing, window, lattice, i, j) : glm::vec3(0, 0, 0));
+					};
+
+					for (int t = 0; t < triangles; t++, lut_edges >>= 12) {
+						int tri_edges[3];
+						for (int v = 0; v < 3; v++)
+							tri_edges[v] = resolved ? resolved[3 * t + v] : (int)(lut_edges >> (4 * v)) & 15;
+
+						Vertex verts[3];
+						for (int v = 0; v < 3; v++) {
+							if (tri_edges[v] < CENTRE_VERTEX) {
+								verts[v] = edge_vert(tri_edges[v]);
+								continue;
+							}
+
+							// A vertex resolve_cell() added in the middle of the cell, the average of a loop's crossings
+							uint16_t loop = centres[tri_edges[v] - CENTRE_VERTEX];
+							Vertex centre(glm::vec3(0, 0, 0), glm::vec3(0, 0, 0));
+							int count = 0;
+							for (int e = 0; e < 12; e++)
+								if (loop >> e & 1) {
+									Vertex on_edge = edge_vert(e);
+									centre.position += on_edge.position;
+									centre.normal += on_edge.normal;
+									count++;
+								}
+							centre.position /= (float)count;
+							float length = glm::length(centre.normal);
+							if (length > 0)
+								centre.normal /= length;
+							verts[v] = centre;
+						}
+						Vertex& vert1 = verts[0];
+						Vertex& vert2 = verts[1];
+						Vertex& vert3 = verts[2];
+
+						if (indexed) {
+							// Each vertex belongs to the lattice edge it lies on, so look the edge up and only create
+							// the vertex the first time any cell touches it. Without gradient normals, normals are summed
+							// over the faces using the vertex here, weighted by area since the cross product isn't
+							// normalized, and normalized later.
+							glm::vec3 face = glm::cross(vert2.position - vert1.position, vert3.position - vert1.position);
+							for (int v = 0; v < 3; v++) {
+								// Vertices in the middle of a cell aren't on a lattice edge, only the cell's own triangles share them
+								uint32_t* centre_slot = tri_edges[v] >= CENTRE_VERTEX ? &centre_slots[tri_edges[v] - CENTRE_VERTEX] : nullptr;
+								const CubeEdge& edge = edgeTable[centre_slot ? 0 : tri_edges[v]];
+								size_t point = (i - i_begin + edge.offset[0]) * box_y_points + (j - j_first + edge.offset[1]);
+								uint32_t& slot = centre_slot ? *centre_slot : edge.axis == AXIS_Z ? z_edges[point]
+									: (edge.offset[2] == 0 ? plane0 : plane1)[point * 2 + edge.axis];
+
+								if (slot == NO_VERTEX) {
+									slot = (uint32_t)out.vertices.size();
+									out.vertices.emplace_back(verts[v]);
+								}
+								if (sum_normals && !centre_slot && edge.axis != AXIS_Z && edge.offset[2] == 0 && k != k_begin) {
+									upper_normals[point * 2 + edge.axis] += face;
+									upper_summed = true;
+								}
+								else if (sum_normals)
+									out.vertices[slot].normal += face;
+								out.indices.push_back(slot);
+							}
+							continue;
+						}
+
+						// Calculate normals here, and all 3 vertices share the same normal.
+						if (!gradient_normals) {
+							glm::vec3 norm = compute_normal(vert1, vert2, vert3);
+							vert1.normal = norm;
+							vert2.normal = norm;
+							vert3.normal = norm;
+						}
+
+						if (emit) {
+							// Chunks hold whole triangles, so a triangle never straddles two of them
+							if (emit_room == 0)
+								emit_to = emit->run(emit_at, emit_room);
+							emit_to[0] = vert1;
+							emit_to[1] = vert2;
+							emit_to[2] = vert3;
+							emit_to += 3;
+							emit_at += 3;
+							emit_room -= 3;
+							continue;
+						}
+
+						out.vertices.emplace_back(vert1);
+						out.vertices.emplace_back(vert2);
+						out.vertices.emplace_back(vert3);
+					}
 				}
 			}
+		}
+
+		if (gradient_normals) {
+			std::swap(below, slice0);
+			std::swap(slice0, slice1);
+			std::swap(slice1, above);
+		}
+		else
+			std::swap(slice0, slice1);
+
+		// Roll the weld cache up a layer too. The first plane is kept before it's recycled, it's the seam with the slab below.
+		// Planes are only cleared if this layer or the last one put vertices in them, empty layers leave them clean.
+		if (indexed) {
+			bool layer_wrote = out.vertices.size() != layer_start;
+			if (k == k_begin)
+				out.bottom_plane = plane0;
+			if (upper_summed) {
+				for (size_t e = 0; e < plane0.size(); e++)
+					if (plane0[e] != NO_VERTEX) {
+						out.vertices[plane0[e]].normal += upper_normals[e];
+						upper_normals[e] = glm::vec3(0, 0, 0);
+					}
+				upper_summed = false;
+			}
+			std::swap(plane0, plane1);
+			if (layer_wrote || last_layer_wrote)
+				std::fill(plane1.begin(), plane1.end(), NO_VERTEX);
+			if (layer_wrote)
+				std::fill(z_edges.begin(), z_edges.end(), NO_VERTEX);
+			last_layer_wrote = layer_wrote;
+		}
+	}
+
+	if (indexed)
+		out.top_plane.swap(plane0);
+}
+
+// Makes a block for publish(), flagged with its brick, the first of a brick's blocks replacing what it had before
+VertexBlock* new_block(uint32_t brick, bool& first) {
+	VertexBlock* block = block_pool.acquire();
+	block->brick = brick;
+	block->replace = brick != NO_BRICK && first;
+	first = false;
+	return block;
+}
+
+// Publishes count vertices of a triangle list, a block at a time
+void publish(const Vertex* triangles, size_t count, uint32_t brick = NO_BRICK) {
+	bool first = true;
+	for (size_t copied = 0; copied < count; ) {
+		VertexBlock* block = new_block(brick, first);
+		block->count = (int)std::min<size_t>(VERTS_PER_BLOCK, count - copied);
+		std::copy(triangles + copied, triangles + copied + block->count, block->vertices);
+		copied += block->count;
+
+		published.push(block);
+	}
+	if (brick != NO_BRICK && first)
+		published.push(new_block(brick, first));
+}
+
+// Chops a finished slab into blocks and publishes them to the render thread. The last block is published
+// partially filled so the slab shows up right away rather than waiting on the next one.
+// A brick of the brick store always gets at least one block, even if it's empty now, to replace its old triangles.
+void publish(const MarchingCubes::Mesh& slab, uint32_t brick = NO_BRICK) {
+	if (slab.indices.empty()) {
+		publish(slab.vertices.data(), slab.vertices.size(), brick);
+		return;
+	}
+
+	// Indexed: fill a block triangle by triangle, copying each vertex in the first time the block uses it.
+	// in_block maps slab vertex ids to ids in the current block, and is reset through the block's own vertex list.
+	// Only the extraction thread publishes, so both are kept between slabs to save allocating them every time.
+	static std::vector<uint32_t> in_block, block_ids;
+	in_block.assign(slab.vertices.size(), NO_VERTEX);
+	block_ids.clear();
+	bool first = true;
+	VertexBlock* block = new_block(brick, first);
+
+	for (size_t t = 0; t < slab.indices.size(); t += 3) {
+		if (block->count + 3 > VERTS_PER_BLOCK || block->index_count + 3 > INDICES_PER_BLOCK) {
+			published.push(block);
+			block = new_block(brick, first);
+			for (uint32_t id : block_ids)
+				in_block[id] = NO_VERTEX;
+			block_ids.clear();
+		}
+
+		for (int v = 0; v < 3; v++) {
+			uint32_t id = slab.indices[t + v];
+			if (in_block[id] == NO_VERTEX) {
+				in_block[id] = block->count;
+				block->vertices[block->count++] = slab.vertices[id];
+				block_ids.push_back(id);
+			}
+			block->indices[block->index_count++] = in_block[id];
+		}
+	}
+
+	if (block->index_count > 0 || block->replace)
+		published.push(block);
+	else
+		block_pool.release(block);
+}
+
+// Normalizes a summed vertex normal, leaving it alone in the unlikely case the faces cancelled out
+void finish_normal(Vertex& v) {
+	float length = glm::length(v.normal);
+	if (length > 0)
+		v.normal /= length;
+}
+
+// Appends an indexed slab onto mesh, whose first vertex has id base. Vertices on the slab's bottom plane already exist
+// as the top plane of the slab below (seam holds their ids), so those are reused, and pick up this slab's share of the
+// normal if normals are being summed from faces.
+template <typename Vertices, typename Indices>
+void weld(const SlabMesh& slab, std::vector<uint32_t>& seam, bool sum_normals, Vertices& mesh_vertices,
+		  Indices& mesh_indices, size_t base = 0) {
+	// Only the extraction thread welds, so this is kept between slabs rather than allocated for every one
+	static std::vector<uint32_t> global_id;
+	global_id.assign(slab.vertices.size(), NO_VERTEX);
+	for (size_t e = 0; e < seam.size(); e++) {
+		uint32_t id = slab.bottom_plane[e];
+		if (id != NO_VERTEX && seam[e] != NO_VERTEX) {
+			global_id[id] = seam[e];
+			if (sum_normals)
+				mesh_vertices[seam[e] - base].normal += slab.vertices[id].normal;
+		}
+	}
+
+	for (size_t v = 0; v < slab.vertices.size(); v++)
+		if (global_id[v] == NO_VERTEX) {
+			global_id[v] = (uint32_t)(base + mesh_vertices.size());
+			mesh_vertices.push_back(slab.vertices[v]);
+		}
+
+	for (uint32_t id : slab.indices)
+		mesh_indices.push_back(global_id[id]);
+
+	// This slab's top plane is the next one's seam
+	seam.assign(slab.top_plane.size(), NO_VERTEX);
+	for (size_t e = 0; e < seam.size(); e++)
+		if (slab.top_plane[e] != NO_VERTEX)
+			seam[e] = global_id[slab.top_plane[e]];
 }
 
-// Writes the vertex information to a ply file, FILENAME SHOULD NOT CONTAIN .PLY
-void writeToPLY(std::vector<Vertex>& vertices, std::string filename) {
+// Slabs that have been merged and emptied, kept from one extraction to the next for workers to march into again,
+// since their buffers are big enough for a slab's triangles already
+std::vector<SlabMesh> spare_slabs;
 
-	std::ofstream outfile((filename+".ply"));
-	std::string header;
-	std::string vertex_data;
-	std::string face_data;
+// Spare slabs kept per worker thread between extractions, the rest are freed
+const size_t SPARE_SLABS_PER_THREAD = 2;
 
-	// BEGIN HEADER
-	header =
-		"ply\n"
-		"format ascii 1.0\n";
-	header += "element vertex " + std::to_string(vertices.size()) + "\n";
+// Memory a finished slab holds on to until it's merged
+size_t slab_bytes(const SlabMesh& slab) {
+	return slab.vertices.size() * sizeof(Vertex)
+		+ (slab.indices.size() + slab.bottom_plane.size() + slab.top_plane.size()) * sizeof(uint32_t);
+}
+
+MarchingCubes::Lattice::Lattice(float min, float max, float stepsize) : min(min), stepsize(stepsize) {
+	// As many cells as it takes to cover [min, max], counted once. A span that's a whole number of steps give or take
+	// rounding gets exactly that many, rather than a sliver of an extra cell whenever the rounding goes the wrong way.
+	double steps = ((double)max - min) / stepsize;
+	size_t count = steps > 0 ? (size_t)std::ceil(steps - 1e-4) : 0;
+	cells[0] = cells[1] = cells[2] = count;
+}
+
+MarchingCubes::Lattice::Lattice(size_t nx, size_t ny, size_t nz, glm::vec3 min, glm::vec3 stepsize) :
+	min(min), stepsize(stepsize) {
+	cells[0] = nx;
+	cells[1] = ny;
+	cells[2] = nz;
+}
+
+// Runs work on the given number of threads and waits for them all to finish
+void run_workers(unsigned threads, const std::function<void()>& work) {
+	std::vector<std::thread> pool;
+	for (unsigned t = 0; t < threads; t++)
+		pool.emplace_back(work);
+	for (std::thread& t : pool)
+		t.join();
+}
+
+// Size of the buffer PLY output is streamed through. The file is written a buffer at a time and never held in memory.
+const size_t PLY_BUFFER_BYTES = 4 << 20;
+
+// Longest text write_float() gives, for FLT_MAX's 39 digits with a sign and 6 decimals, and the separator after it
+const size_t MAX_FLOAT_CHARS = 1 + 39 + 1 + 6 + 1;
+
+// Fixed-size write buffer in front of an ofstream. Callers reserve room, format straight into it, then commit.
+class PLYStream {
+public:
+	PLYStream(const std::string& path) : outfile(path, std::ios::binary), buffer(new char[PLY_BUFFER_BYTES]) {}
+	~PLYStream() { flush(); }
+
+	// Returns a pointer with at least bytes of room after it, flushing first if the buffer can't fit them
+	char* reserve(size_t bytes) {
+		if (used + bytes > PLY_BUFFER_BYTES)
+			flush();
+		return buffer.get() + used;
+	}
+
+	void commit(char* end) {
+		used = end - buffer.get();
+	}
+
+	void write(const void* data, size_t bytes) {
+		// Anything bigger than the buffer goes straight to the file instead of being chopped up
+		if (bytes >= PLY_BUFFER_BYTES) {
+			flush();
+			outfile.write((const char*)data, bytes);
+			written += bytes;
+			return;
+		}
+		char* out = reserve(bytes);
+		std::memcpy(out, data, bytes);
+		commit(out + bytes);
+	}
+
+	void flush() {
+		outfile.write(buffer.get(), used);
+		written += used;
+		used = 0;
+	}
+
+	size_t bytesWritten() const { return written + used; }
+
+	// Writes over bytes already in the file at offset, e.g. to fill in a header, and carries on from the end
+	void overwrite(size_t offset, const void* data, size_t bytes) {
+		flush();
+		outfile.seekp(offset);
+		outfile.write((const char*)data, bytes);
+		outfile.seekp(0, std::ios::end);
+	}
+
+	// Whether the file failed to open or a write to it failed
+	bool failed() const { return !outfile; }
+
+private:
+	std::ofstream outfile;
+	std::unique_ptr<char[]> buffer;
+	size_t used = 0;
+	size_t written = 0;
+};
+
+// Same output as std::to_string(float), without going through a temporary string. Leaves room for a separator.
+char* write_float(char* out, float value) {
+	std::to_chars_result result = std::to_chars(out, out + MAX_FLOAT_CHARS - 1, value, std::chars_format::fixed, 6);
+	// Any float fits, but if one somehow didn't, write it the short way rather than leave the field empty
+	if (result.ec != std::errc())
+		result = std::to_chars(out, out + MAX_FLOAT_CHARS - 1, value, std::chars_format::general);
+	return result.ptr;
+}
+
+char* write_uint(char* out, uint32_t value) {
+	return std::to_chars(out, out + MAX_FLOAT_CHARS, value).ptr;
+}
+
+bool little_endian_host() {
+	const uint16_t probe = 1;
+	return *(const uint8_t*)&probe == 1;
+}
+
+// Header for a mesh with the given counts. With count_width, the counts are padded out to that many characters so
+// the header can be written before they're known and rewritten over itself, the same length, once they are.
+std::string ply_header(bool binary, size_t vertex_count, size_t face_count, size_t count_width = 0) {
+	auto count = [count_width](size_t n) {
+		std::string text = std::to_string(n);
+		return std::string(count_width > text.size() ? count_width - text.size() : 0, ' ') + text;
+	};
+
+	std::string header =
+		"ply\n";
+	header += binary ? "format binary_little_endian 1.0\n" : "format ascii 1.0\n";
+	header += "element vertex " + count(vertex_count) + "\n";
 	header +=
 		"property float x\n"
 		"property float y\n"
@@ -179,103 +717,1387 @@ void writeToPLY(std::vector<Vertex>& vertices, std::string filename) {
 		"property float ny\n"
 		"property float nz\n";
 	header += 
-		"element face " + std::to_string(vertices.size() / 3) + "\n"
+		"element face " + count(face_count) + "\n"
 		"property list uchar uint vertex_indices\n"
 		"end_header\n";
+	return header;
+}
 
-	// BODY INFORMATION (Vertex)
-	for (const Vertex& v : vertices) {
-		vertex_data +=  std::to_string(v.position.x) + " " + 
-						std::to_string(v.position.y) + " " + 
-						std::to_string(v.position.z) + " " + 
-						std::to_string(v.normal.x) + " " + 
-						std::to_string(v.normal.y) + " " +
-						std::to_string(v.normal.z) + "\n";
+void write_vertices(PLYStream& outfile, bool binary, const Vertex* vertices, size_t count) {
+	if (binary) {
+		outfile.write(vertices, count * sizeof(Vertex));
+		return;
 	}
 
-	// BODY INFORMATION (Face, unique vertices so follow pattern)
-	for (int i = 0; i < vertices.size(); i += 3)
-		face_data += "3 " + std::to_string(i) + " " + std::to_string(i+1) + " " + std::to_string(i+2) + "\n";
+	for (size_t n = 0; n < count; n++) {
+		const Vertex& v = vertices[n];
+		char* out = outfile.reserve(6 * MAX_FLOAT_CHARS);
+		out = write_float(out, v.position.x); *out++ = ' ';
+		out = write_float(out, v.position.y); *out++ = ' ';
+		out = write_float(out, v.position.z); *out++ = ' ';
+		out = write_float(out, v.normal.x); *out++ = ' ';
+		out = write_float(out, v.normal.y); *out++ = ' ';
+		out = write_float(out, v.normal.z); *out++ = '\n';
+		outfile.commit(out);
+	}
+}
 
-	outfile << header;
-	outfile << vertex_data;
-	outfile << face_data;
+// Writes count faces, from indices if given, or otherwise as a triangle soup starting at face first where every
+// 3 vertices make a triangle
+void write_faces(PLYStream& outfile, bool binary, const uint32_t* indices, size_t first, size_t count) {
+	const size_t FACE_BYTES = 1 + 3 * sizeof(uint32_t);
+	for (size_t f = 0; f < count; f++) {
+		uint32_t face[3];
+		for (int v = 0; v < 3; v++)
+			face[v] = indices ? indices[3 * f + v] : (uint32_t)(3 * (first + f) + v);
 
-	outfile.close();
+		if (binary) {
+			char* out = outfile.reserve(FACE_BYTES);
+			*out = 3;
+			std::memcpy(out + 1, face, sizeof(face));
+			outfile.commit(out + FACE_BYTES);
+		}
+		else {
+			char* out = outfile.reserve(4 * MAX_FLOAT_CHARS);
+			*out++ = '3'; *out++ = ' ';
+			out = write_uint(out, face[0]); *out++ = ' ';
+			out = write_uint(out, face[1]); *out++ = ' ';
+			out = write_uint(out, face[2]); *out++ = '\n';
+			outfile.commit(out);
+		}
+	}
 }
 
-void MarchingCubes::init(std::function<float(float, float, float)> f, float isovalue, 
-	float min, float max, float stepsize) {
+// Binary records are written straight from memory, which needs both the layout and byte order to match the file's
+bool binary_ply(MarchingCubes::PLYFormat format) {
+	static_assert(sizeof(Vertex) == 6 * sizeof(float), "Vertex must be 6 packed floats to be written as-is");
+	return format == MarchingCubes::PLYFormat::Binary && little_endian_host();
+}
 
-	// First, get our vertices from marching cubes asynchronously
-	marching_cubes(f, isovalue, min, max, stepsize);
+// Writes the vertex information to a ply file at path, which should include the .ply
+// If indices is empty, every 3 vertices are taken as a triangle. Returns the number of bytes written, 0 if it couldn't be.
+size_t writeToPLY(const MarchingCubes::VertexChunks& vertices, const IndexChunks& indices,
+				  const std::string& path, MarchingCubes::PLYFormat format) {
 
-	std::cout << "Writing vertices to file..." << std::endl;
-	// When vertices are finished, we can write to a PLY file.
-	writeToPLY(vertices, "output");
-	std::cout << "Done writing to file." << std::endl;
+	bool binary = binary_ply(format);
+
+	PLYStream outfile(path);
+	size_t face_count = indices.empty() ? vertices.size() / 3 : indices.size() / 3;
+
+	std::string header = ply_header(binary, vertices.size(), face_count);
+	outfile.write(header.data(), header.size());
+
+	vertices.for_each_run(0, vertices.size(), [&](const Vertex* run, size_t count) {
+		write_vertices(outfile, binary, run, count);
+	});
+	if (indices.empty())
+		write_faces(outfile, binary, nullptr, 0, face_count);
+	indices.for_each_run(0, indices.size(), [&](const uint32_t* run, size_t count) {
+		write_faces(outfile, binary, run, 0, count / 3);
+	});
+
+	outfile.flush();
+	return outfile.failed() ? 0 : outfile.bytesWritten();
+}
+
+// Enough digits for any count a uint32_t index can reach
+const size_t PLY_COUNT_WIDTH = 10;
+// Biggest counts a streamed PLY can hold: faces index vertices with a uint32_t (less NO_VERTEX, which the weld keeps
+// back), and any count has to fit in the header's PLY_COUNT_WIDTH digits
+const size_t PLY_MAX_VERTICES = NO_VERTEX;
+const size_t PLY_MAX_COUNT = 9999999999ull;
+
+// Faces read back from the scratch file at a time
+const size_t SCRATCH_FACES = 1 << 16;
+
+// A PLY file written as the mesh is extracted. PLY wants every vertex before the first face, so vertices go straight
+// into the file and an indexed mesh's faces go to a scratch file next to it, which finish() copies onto the end.
+// A triangle soup's faces are just 0 1 2, 3 4 5, ... so those are made up at the end instead.
+class StreamedPLY {
+public:
+	bool open(const std::string& path, MarchingCubes::PLYFormat format, bool indexed) {
+		this->path = path;
+		binary = binary_ply(format);
+		scratch_path = indexed ? path + ".faces" : "";
+		vertex_count = face_count = bytes = 0;
+
+		file.reset(new PLYStream(path));
+		std::string header = ply_header(binary, 0, 0, PLY_COUNT_WIDTH);
+		file->write(header.data(), header.size());
+		if (indexed)
+			scratch.open(scratch_path, std::ios::binary | std::ios::trunc);
+
+		if (file->failed() || (indexed && !scratch)) {
+			std::cout << "Couldn't write to " << (file->failed() ? path : scratch_path) << std::endl;
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void add_vertices(const Vertex* vertices, size_t count) {
+		write_vertices(*file, binary, vertices, count);
+		vertex_count += count;
+	}
+
+	// Takes the faces of an indexed mesh, 3 indices each
+	void add_faces(const uint32_t* indices, size_t count) {
+		scratch.write((const char*)indices, count * sizeof(uint32_t));
+		face_count += count / 3;
+	}
+
+	// Appends the faces, fills in the header's counts and closes the file, returning its size or 0 if it couldn't be written
+	size_t finish() {
+		if (!file)
+			return 0;
+
+		size_t faces = scratch_path.empty() ? vertex_count / 3 : face_count;
+		if (vertex_count > PLY_MAX_VERTICES || faces > PLY_MAX_COUNT) {
+			std::cout << "Too many vertices (" << vertex_count << ") or faces (" << faces << ") for a PLY file, removing "
+				<< path << std::endl;
+			close();
+			std::remove(path.c_str());
+			return bytes = 0;
+		}
+
+		if (scratch_path.empty()) {
+			face_count = vertex_count / 3;
+			write_faces(*file, binary, nullptr, 0, face_count);
+		}
+		else {
+			scratch.close();
+			std::ifstream faces(scratch_path, std::ios::binary);
+			std::vector<uint32_t> chunk(3 * SCRATCH_FACES);
+			while (faces.read((char*)chunk.data(), chunk.size() * sizeof(uint32_t)) || faces.gcount() > 0)
+				write_faces(*file, binary, chunk.data(), 0, (size_t)faces.gcount() / (3 * sizeof(uint32_t)));
+		}
+
+		std::string header = ply_header(binary, vertex_count, face_count, PLY_COUNT_WIDTH);
+		file->overwrite(0, header.data(), header.size());
+		file->flush();
+		bytes = file->failed() ? 0 : file->bytesWritten();
+		close();
+		return bytes;
+	}
+
+	std::string path;
+	size_t vertex_count = 0, face_count = 0;
+	size_t bytes = 0; // Size of the finished file
+
+private:
+	void close() {
+		file.reset();
+		if (scratch.is_open())
+			scratch.close();
+		if (!scratch_path.empty())
+			std::remove(scratch_path.c_str());
+	}
+
+	std::unique_ptr<PLYStream> file;
+	std::ofstream scratch;
+	std::string scratch_path;
+	bool binary = false;
+};
+
+StreamedPLY streamed; // The last streamed extraction
+
+// Depth of the slabs a streamed extraction is split into at most, so that each slab's triangles stay a small part of
+// the memory cap however big the lattice is. Checkpointed ones too, so not much work is lost when the run's killed.
+const size_t STREAM_SLAB_CELLS = 16;
+
+// Writes a merged slab out to stream. An indexed slab's faces go out straight away, but its vertices wait until the
+// next slab has been welded on, since those on its top plane are shared with it (and summed normals need its faces).
+// pending holds the vertices not written yet, starting from id base.
+void stream_slab(StreamedPLY& stream, const SlabMesh& slab, const std::vector<uint32_t>& seam,
+				 MarchingCubes::Mesh& pending, size_t& base, bool indexed, bool sum_normals) {
+	if (!indexed) {
+		stream.add_vertices(slab.vertices.data(), slab.vertices.size());
+		return;
+	}
+
+	stream.add_faces(pending.indices.data(), pending.indices.size());
+	pending.indices.clear();
+
+	// The seam is all this slab's own vertices, so everything before the first of them is done
+	size_t done = base + pending.vertices.size();
+	for (uint32_t id : seam)
+		if (id != NO_VERTEX)
+			done = std::min<size_t>(done, id);
+
+	size_t count = done - base;
+	if (sum_normals)
+		for (size_t v = 0; v < count; v++)
+			finish_normal(pending.vertices[v]);
+	stream.add_vertices(pending.vertices.data(), count);
+	pending.vertices.erase(pending.vertices.begin(), pending.vertices.begin() + count);
+	base = done;
+}
+
+// What a checkpoint is of. Slabs can only be reused by an extraction of the same lattice with the same options, and
+// the slab depth comes from the file, since it depends on the number of threads the first run had.
+struct CheckpointHeader {
+	char magic[8] = { 'M', 'C', 'S', 'L', 'A', 'B', 'S', '1' };
+	uint32_t flags = 0; // One bit per option that changes the triangles
+	float isovalue = 0;
+	uint64_t cells[3] = { 0, 0, 0 };
+	float min[3] = { 0, 0, 0 };
+	float stepsize[3] = { 0, 0, 0 };
+	uint64_t depth = 0;
+
+	CheckpointHeader() = default;
+	CheckpointHeader(float isovalue, const MarchingCubes::Lattice& lattice, const MarchingCubes::Options& options,
+					 size_t depth) : isovalue(isovalue), depth(depth) {
+		flags = (options.indexed ? 1 : 0) | (options.interpolate ? 2 : 0) | (options.gradient_normals ? 4 : 0)
+			| (options.asymptotic_decider ? 8 : 0);
+		for (int axis = 0; axis < 3; axis++) {
+			cells[axis] = lattice.cells[axis];
+			min[axis] = lattice.min[axis];
+			stepsize[axis] = lattice.stepsize[axis];
+		}
+	}
+
+	// Everything but the depth matches
+	bool same_extraction(const CheckpointHeader& other) const {
+		CheckpointHeader copy = other;
+		copy.depth = depth;
+		return std::memcmp(this, &copy, sizeof(copy)) == 0;
+	}
+};
+static_assert(sizeof(CheckpointHeader) == 8 + 4 + 4 + 24 + 12 + 12 + 8, "CheckpointHeader mustn't have padding");
+
+// Sizes of a slab saved in a checkpoint, ahead of its vertices, indices and the used slots of its two weld planes
+// (as pairs of slot and vertex id)
+struct SlabRecord {
+	uint64_t slab;
+	uint64_t vertices, indices;
+	uint64_t plane_size, bottom_used, top_used;
+
+	size_t data_bytes() const {
+		return vertices * sizeof(Vertex) + indices * sizeof(uint32_t) + (bottom_used + top_used) * 2 * sizeof(uint32_t);
+	}
+};
+
+// Slabs of an extraction saved in z order as they're merged, so one that's killed can carry on from the last of them.
+// Each slab is written in one go and flushed, and a slab that was cut off partway when the extraction died is
+// dropped when the file's opened again.
+class SlabCheckpoint {
+public:
+	// Opens path for the extraction described by header, returning the number of slabs already saved in it, which
+	// are read back with read(). If there are any, depth is set to the slab depth they were marched with.
+	size_t open(const std::string& path, CheckpointHeader header, size_t& depth) {
+		this->path = path;
+		size_t saved = 0;
+		uint64_t end = sizeof(CheckpointHeader);
+
+		std::ifstream existing(path, std::ios::binary);
+		CheckpointHeader found;
+		if (existing.read((char*)&found, sizeof(found))) {
+			if (header.same_extraction(found)) {
+				// Count the slabs that were written in full
+				existing.seekg(0, std::ios::end);
+				uint64_t size = existing.tellg();
+				SlabRecord record;
+				existing.seekg(end);
+				while (existing.read((char*)&record, sizeof(record)) && record.slab == saved
+					   && end + sizeof(record) + record.data_bytes() <= size) {
+					end += sizeof(record) + record.data_bytes();
+					existing.seekg(end);
+					saved++;
+				}
+				if (saved > 0) {
+					header.depth = found.depth;
+					depth = (size_t)found.depth;
+					std::cout << "Resuming from " << path << ", " << saved << " slabs done" << std::endl;
+				}
+			}
+			else
+				std::cout << path << " is a checkpoint of a different extraction, starting over" << std::endl;
+		}
+		existing.close();
+
+		// Start the file again from its header, or cut it back to the last whole slab and carry on from there
+		if (saved == 0) {
+			std::ofstream(path, std::ios::binary | std::ios::trunc).write((const char*)&header, sizeof(header));
+			end = sizeof(header);
+		}
+		std::error_code error;
+		std::filesystem::resize_file(path, end, error);
+		file.open(path, std::ios::binary | std::ios::app);
+		if (error || !file) {
+			std::cout << "Couldn't write to " << path << std::endl;
+			file.close();
+			return 0;
+		}
+
+		if (saved > 0) {
+			saved_slabs.open(path, std::ios::binary);
+			saved_slabs.seekg(sizeof(CheckpointHeader));
+		}
+		return saved;
+	}
+
+	// The next of the slabs that were already saved
+	bool read(SlabMesh& slab) {
+		SlabRecord record;
+		if (!saved_slabs.read((char*)&record, sizeof(record)))
+			return false;
+
+		slab.vertices.resize(record.vertices);
+		slab.indices.resize(record.indices);
+		saved_slabs.read((char*)slab.vertices.data(), record.vertices * sizeof(Vertex));
+		saved_slabs.read((char*)slab.indices.data(), record.indices * sizeof(uint32_t));
+		read_plane(slab.bottom_plane, record.plane_size, record.bottom_used);
+		read_plane(slab.top_plane, record.plane_size, record.top_used);
+		return (bool)saved_slabs;
+	}
+
+	// Saves slab s, the next one along
+	void write(size_t s, const SlabMesh& slab) {
+		if (!file.is_open())
+			return;
+
+		SlabRecord record = { s, slab.vertices.size(), slab.indices.size(), slab.bottom_plane.size(),
+			used_slots(slab.bottom_plane), used_slots(slab.top_plane) };
+		file.write((const char*)&record, sizeof(record));
+		file.write((const char*)slab.vertices.data(), slab.vertices.size() * sizeof(Vertex));
+		file.write((const char*)slab.indices.data(), slab.indices.size() * sizeof(uint32_t));
+		write_plane(slab.bottom_plane);
+		write_plane(slab.top_plane);
+		file.flush();
+	}
+
+	// Closes the file, deleting it if the extraction got through every slab and it isn't needed any more
+	void close(bool complete) {
+		saved_slabs.close();
+		if (!file.is_open())
+			return;
+		file.close();
+		if (complete)
+			std::remove(path.c_str());
+	}
+
+private:
+	static size_t used_slots(const std::vector<uint32_t>& plane) {
+		return (size_t)std::count_if(plane.begin(), plane.end(), [](uint32_t id) { return id != NO_VERTEX; });
+	}
+
+	void write_plane(const std::vector<uint32_t>& plane) {
+		for (size_t slot = 0; slot < plane.size(); slot++)
+			if (plane[slot] != NO_VERTEX) {
+				uint32_t pair[2] = { (uint32_t)slot, plane[slot] };
+				file.write((const char*)pair, sizeof(pair));
+			}
+	}
+
+	void read_plane(std::vector<uint32_t>& plane, size_t size, size_t used) {
+		plane.assign(size, NO_VERTEX);
+		for (size_t p = 0; p < used && saved_slabs; p++) {
+			uint32_t pair[2];
+			saved_slabs.read((char*)pair, sizeof(pair));
+			if (pair[0] < size)
+				plane[pair[0]] = pair[1];
+		}
+	}
+
+	std::string path;
+	std::ofstream file;
+	std::ifstream saved_slabs;
+};
+
+// Populates a vector passed in as an argument. Samples f as it goes, or reads the samples out of cached if given.
+// Given a stream, the mesh is written to that instead. Returns false if it was stopped before the end, through
+// Options::job, keeping the slabs up to where it stopped.
+bool marching_cubes(const MarchingCubes::SliceSampler& f, float isovalue, const MarchingCubes::Lattice& lattice,
+					unsigned threads, const MarchingCubes::Options& options, const SampleGrid* cached = nullptr,
+					StreamedPLY* stream = nullptr) {
+
+	const bool indexed = options.indexed;
+	const bool sum_normals = indexed && !options.gradient_normals;
+	if (lattice.empty())
+		return true;
+
+	const size_t cells = lattice.cells[2];
+	const size_t layer_cells = lattice.cells[0] * lattice.cells[1];
+	MarchingCubes::Job* job = options.job;
+
+	// Split the domain into z-slabs, several per thread. Threads grab the next unclaimed slab whenever they finish one,
+	// so a thread that drew empty slabs keeps pulling work while the others are stuck on dense parts of the surface.
+	size_t depth = std::max<size_t>(1, cells / (threads * SLABS_PER_THREAD));
+	if (stream || !options.checkpoint.empty())
+		depth = std::min(depth, STREAM_SLAB_CELLS);
+
+	// Slabs already in the checkpoint are read back in place of marching them, which needs the depth they were made with
+	SlabCheckpoint checkpoint;
+	size_t resumed = 0;
+	if (!options.checkpoint.empty())
+		resumed = checkpoint.open(options.checkpoint, CheckpointHeader(isovalue, lattice, options, depth), depth);
+	const size_t slab_count = (cells + depth - 1) / depth;
+	resumed = std::min(resumed, slab_count);
+	auto slab_cells = [&](size_t s) { return (std::min(cells, (s + 1) * depth) - s * depth) * layer_cells; };
+
+	std::vector<SlabMesh> slabs(slab_count);
+	std::vector<char> slab_finished(slab_count, false);
+	size_t merging = 0;      // Slab the merge is waiting on
+	size_t queued_bytes = 0; // Held by slabs that are finished but not merged yet
+	size_t marching = 0;     // Slabs being marched
+	size_t merged_bytes = 0; // Over every merged slab, to estimate what the ones being marched will hold
+	unsigned running = threads; // Workers that haven't stopped yet
+	std::vector<SlabMesh> spare; // Merged slabs, emptied for workers to march into again
+	spare.swap(spare_slabs);
+	std::mutex slab_mutex;   // Guards all of the above
+	std::condition_variable slab_done, slab_merged;
+	std::atomic<size_t> next_slab{ resumed };
+	std::atomic<bool> stop{ false }; // The merge couldn't carry on, so there's no point marching any more
+	auto stopping = [&]() { return stop || (job && job->cancelled); };
+
+	auto worker = [&]() {
+		for (size_t s = next_slab++; s < slab_count && !stopping(); s = next_slab++) {
+			// With a memory cap, wait for the merge to catch up rather than piling more slabs up behind it. Slabs
+			// being marched count as the average merged slab. The slab the merge is waiting on always goes ahead,
+			// or it never would, so a tight cap just leaves fewer threads working.
+			if (options.memory_cap > 0) {
+				std::unique_lock<std::mutex> lock(slab_mutex);
+				slab_merged.wait(lock, [&]() {
+					size_t average = merging > 0 ? merged_bytes / merging : 0;
+					return s == merging || queued_bytes + (marching + 1) * average <= options.memory_cap || stopping();
+				});
+				if (stopping())
+					break;
+				marching++;
+			}
+
+			SlabMesh local;
+			{
+				std::lock_guard<std::mutex> lock(slab_mutex);
+				if (!spare.empty()) {
+					local = std::move(spare.back());
+					spare.pop_back();
+				}
+			}
+			CellBox slab = { { 0, 0, s * depth }, { lattice.cells[0], lattice.cells[1], std::min(cells, (s + 1) * depth) } };
+			march_slab(f, isovalue, lattice, slab, options, local, cached);
+			{
+				std::lock_guard<std::mutex> lock(slab_mutex);
+				if (options.memory_cap > 0)
+					marching--;
+				queued_bytes += slab_bytes(local);
+				slabs[s] = std::move(local);
+				slab_finished[s] = true;
+			}
+			slab_done.notify_one();
+			if (job)
+				job->cells_done += slab_cells(s);
+		}
+
+		// When stopping, the merge waits on all the workers being gone rather than on slabs that won't come, and
+		// anyone held up by the memory cap needs waking to notice
+		{
+			std::lock_guard<std::mutex> lock(slab_mutex);
+			running--;
+		}
+		slab_done.notify_one();
+		slab_merged.notify_all();
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 0; t < threads; t++)
+		pool.emplace_back(worker);
+
+	// Hand slabs over strictly in z order as they finish, so the mesh is identical no matter how many threads ran.
+	// A streamed mesh is welded into pending, which only ever holds the vertices that haven't been written yet.
+	std::vector<uint32_t> seam;
+	MarchingCubes::Mesh pending;
+	size_t pending_base = 0;
+	size_t merged = 0;
+	for (size_t s = 0; s < slab_count; s++) {
+		SlabMesh slab;
+		if (s < resumed) {
+			if (!checkpoint.read(slab)) {
+				std::cout << "Couldn't read slab " << s << " back from " << options.checkpoint << std::endl;
+				stop = true;
+				slab_merged.notify_all();
+				break;
+			}
+			if (job)
+				job->cells_done += slab_cells(s);
+			std::lock_guard<std::mutex> lock(slab_mutex);
+			merged_bytes += slab_bytes(slab);
+			merging = s + 1;
+		}
+		else {
+			std::unique_lock<std::mutex> lock(slab_mutex);
+			slab_done.wait(lock, [&]() { return slab_finished[s] != 0 || running == 0; });
+			if (!slab_finished[s])
+				break;
+			slab = std::move(slabs[s]);
+			queued_bytes -= slab_bytes(slab);
+			merged_bytes += slab_bytes(slab);
+			merging = s + 1;
+		}
+		slab_merged.notify_all();
+		merged = s + 1;
+
+		if (s >= resumed)
+			checkpoint.write(s, slab);
+		if (job)
+			job->triangles += (indexed ? slab.indices.size() : slab.vertices.size()) / 3;
+
+		if (indexed && stream)
+			weld(slab, seam, sum_normals, pending.vertices, pending.indices, pending_base);
+		else if (indexed)
+			weld(slab, seam, sum_normals, vertices, indices);
+
+		// The render thread gets this slab on its own, so finish its normals locally. The global copies
+		// along the top plane still wait on the next slab's faces before they're normalized.
+		if (sum_normals)
+			for (Vertex& v : slab.vertices)
+				finish_normal(v);
+
+		if (stream)
+			stream_slab(*stream, slab, seam, pending, pending_base, indexed, sum_normals);
+		else if (!indexed)
+			vertices.append(slab.vertices.data(), slab.vertices.size());
+
+		if (options.publish)
+			publish(slab);
+
+		slab.vertices.clear();
+		slab.indices.clear();
+		std::lock_guard<std::mutex> lock(slab_mutex);
+		spare.push_back(std::move(slab));
+	}
+
+	// Nothing's left to share the last slab's vertices with
+	if (stream && indexed) {
+		seam.clear();
+		stream_slab(*stream, SlabMesh(), seam, pending, pending_base, indexed, sum_normals);
+	}
+	else if (sum_normals)
+		for (size_t v = 0; v < vertices.size(); v++)
+			finish_normal(vertices[v]);
+
+	for (std::thread& t : pool)
+		t.join();
+
+	checkpoint.close(merged == slab_count);
+	spare.resize(std::min(spare.size(), threads * SPARE_SLABS_PER_THREAD));
+	spare_slabs.swap(spare);
+	return merged == slab_count;
+}
+
+// Resolves Options::threads to the number of workers to actually start
+unsigned worker_count(const MarchingCubes::Options& options) {
+	if (options.threads > 0)
+		return options.threads;
+	return std::max(1u, std::thread::hardware_concurrency());
 }
 
-void MarchingCubes::update() {
-	std::lock_guard<std::mutex> lock(mutex);
-	// If vertices haven't been added, no work needs to be done.
-	if (lastIndex == vertices.size())
+// Triangles the cells of box in the cached grid make, counted from their cases without emitting any
+size_t count_triangles(float isovalue, const SampleGrid& cached, const CellBox& box, const MarchingCubes::Options& options) {
+	static const ClassifyRow classify_row = select_classifier(true);
+	ClassifyRow classify = options.simd ? classify_row : select_classifier(false);
+	uint8_t resolved_edges[3 * MAX_RESOLVED_TRIANGLES];
+	uint16_t centres[MAX_CENTRES];
+
+	const ActiveBricks& active = cached.active;
+	const size_t y_points = cached.lattice.points(1);
+	std::vector<uint8_t> row_cases(BRICK_CELLS);
+	size_t triangles = 0;
+
+	for (size_t k = box.begin[2]; k < box.end[2]; k++) {
+		const std::vector<float>& lower = cached.slices[k];
+		const std::vector<float>& upper = cached.slices[k + 1];
+		const size_t bk = k / BRICK_CELLS;
+		if (!active.has_layer(bk))
+			continue;
+
+		for (size_t i = box.begin[0]; i < box.end[0]; i++) {
+			if (!active.has_row(bk, i / BRICK_CELLS))
+				continue;
+
+			for (size_t j_begin = box.begin[1]; j_begin < box.end[1]; j_begin += BRICK_CELLS) {
+				if (!active.has_brick(bk, i / BRICK_CELLS, j_begin / BRICK_CELLS))
+					continue;
+				const size_t count = std::min(box.end[1], j_begin + BRICK_CELLS) - j_begin;
+
+				classify(&lower[i * y_points + j_begin], &lower[(i + 1) * y_points + j_begin], &upper[i * y_points + j_begin],
+						 &upper[(i + 1) * y_points + j_begin], count, isovalue, row_cases.data());
+				for (size_t j = 0; j < count; j++) {
+					const int marching_case = row_cases[j];
+					if (!options.asymptotic_decider || !has_ambiguous_face(marching_case)) {
+						triangles += packed_lut.triangles(marching_case);
+						continue;
+					}
+
+					// Same corners as march_slab
+					size_t left = i * y_points + j_begin + j, right = left + y_points;
+					const float corners[8] = { lower[left], lower[right], upper[right], upper[left],
+						lower[left + 1], lower[right + 1], upper[right + 1], upper[left + 1] };
+					triangles += resolve_cell(corners, isovalue, marching_case, resolved_edges, centres);
+				}
+			}
+		}
+	}
+	return triangles;
+}
+
+// Extracts a triangle list from the cached grid in two passes. The first counts each slab's triangles from its cells'
+// cases, a prefix sum over those gives every slab its place in the mesh, and the mesh is grown to fit exactly once.
+// The second marches the slabs again, each writing straight into its own place, so slabs never get copied around
+// and threads never wait on each other. Only the publishing, in z order, waits on slabs to finish.
+// Returns false if it was stopped through Options::job, keeping the slabs up to the first one that wasn't marched.
+bool two_pass_cached(float isovalue, unsigned threads, const MarchingCubes::Options& options) {
+	const MarchingCubes::Lattice& lattice = grid.lattice;
+	if (lattice.empty())
+		return true;
+	MarchingCubes::Job* job = options.job;
+	auto cancelled = [&]() { return job && job->cancelled; };
+
+	const size_t cells = lattice.cells[2];
+	const size_t depth = std::max<size_t>(1, cells / (threads * SLABS_PER_THREAD));
+	const size_t slab_count = (cells + depth - 1) / depth;
+	auto slab_box = [&](size_t s) {
+		return CellBox{ { 0, 0, s * depth }, { lattice.cells[0], lattice.cells[1], std::min(cells, (s + 1) * depth) } };
+	};
+
+	std::vector<size_t> first(slab_count + 1, 0); // Counts, then the first triangle of each slab
+	std::atomic<size_t> next_slab{ 0 };
+	run_workers(threads, [&]() {
+		for (size_t s = next_slab++; s < slab_count && !cancelled(); s = next_slab++)
+			first[s + 1] = count_triangles(isovalue, grid, slab_box(s), options);
+	});
+	if (cancelled())
+		return false;
+	for (size_t s = 0; s < slab_count; s++)
+		first[s + 1] += first[s];
+
+	const size_t base = vertices.size();
+	vertices.resize(base + 3 * first[slab_count]);
+
+	std::vector<char> slab_finished(slab_count, false);
+	unsigned running = threads; // Workers that haven't stopped yet
+	std::mutex slab_mutex;
+	std::condition_variable slab_done;
+	next_slab = 0;
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 0; t < threads; t++)
+		pool.emplace_back([&]() {
+			for (size_t s = next_slab++; s < slab_count && !cancelled(); s = next_slab++) {
+				SlabMesh unused;
+				CellBox box = slab_box(s);
+				march_slab(MarchingCubes::SliceSampler(), isovalue, lattice, box, options, unused, &grid,
+						   &vertices, base + 3 * first[s]);
+				if (job)
+					job->cells_done += (box.end[2] - box.begin[2]) * lattice.cells[0] * lattice.cells[1];
+				{
+					std::lock_guard<std::mutex> lock(slab_mutex);
+					slab_finished[s] = true;
+				}
+				slab_done.notify_one();
+			}
+			{
+				std::lock_guard<std::mutex> lock(slab_mutex);
+				running--;
+			}
+			slab_done.notify_one();
+		});
+
+	// The render thread gets the slabs in order as they finish, same as a single pass extraction
+	size_t kept = 0;
+	for (; kept < slab_count; kept++) {
+		{
+			std::unique_lock<std::mutex> lock(slab_mutex);
+			slab_done.wait(lock, [&]() { return slab_finished[kept] != 0 || running == 0; });
+			if (!slab_finished[kept])
+				break;
+		}
+		if (job)
+			job->triangles += first[kept + 1] - first[kept];
+		if (options.publish)
+			vertices.for_each_run(base + 3 * first[kept], 3 * (first[kept + 1] - first[kept]), [](const Vertex* run, size_t count) {
+				publish(run, count);
+			});
+	}
+
+	for (std::thread& t : pool)
+		t.join();
+
+	// Slabs past one that was never marched are dropped with it, so what's left is whole from the bottom up
+	vertices.resize(base + 3 * first[kept]);
+	return kept == slab_count;
+}
+
+// Fills in the stats of an extraction over lattice that just finished, and prints them
+MarchingCubes::ExtractStats report_extraction(const MarchingCubes::Lattice& lattice, size_t evaluations_before,
+	double seconds, unsigned threads, const MarchingCubes::Options& options, bool complete = true) {
+	const bool streaming = !options.stream_to.empty();
+	MarchingCubes::ExtractStats stats;
+	stats.cells = lattice.cell_count();
+	stats.triangles = streaming ? streamed.face_count : indices.empty() ? vertices.size() / 3 : indices.size() / 3;
+	stats.vertices = streaming ? streamed.vertex_count : vertices.size();
+	stats.field_evaluations = field_evals - evaluations_before;
+	stats.seconds = seconds;
+	stats.cancelled = !complete;
+
+	if (stats.cancelled)
+		std::cout << "Cancelled after " << (options.job ? options.job->cells_done.load() : 0) << " of " << stats.cells
+			<< " cells" << std::endl;
+	std::cout << "Extracted " << stats.triangles << " triangles (" << stats.vertices << " vertices) in "
+		<< seconds << "s on " << threads << " threads, " << classifier_name(options.simd) << " classification" << std::endl;
+	return stats;
+}
+
+// Runs the extraction into Options::stream_to if it's set, returning false if it isn't. Whatever was merged before a
+// cancel is still written out as a whole file.
+bool streamed_extraction(const MarchingCubes::SliceSampler& f, float isovalue, const MarchingCubes::Lattice& lattice,
+						 unsigned threads, const MarchingCubes::Options& options, bool& complete,
+						 const SampleGrid* cached = nullptr) {
+	if (options.stream_to.empty())
+		return false;
+
+	if (streamed.open(options.stream_to, options.ply_format, options.indexed)) {
+		complete = marching_cubes(f, isovalue, lattice, threads, options, cached, &streamed);
+		streamed.finish();
+	}
+	return true;
+}
+
+// Sets job, if there is one, going on an extraction of lattice that started at start
+void start_job(MarchingCubes::Job* job, const MarchingCubes::Lattice& lattice, std::chrono::steady_clock::time_point start) {
+	if (!job)
 		return;
+	job->cells_done = 0;
+	job->cells_total = lattice.cell_count();
+	job->triangles = 0;
+	job->started = std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count();
+}
 
-	// If we don't have any buffers yet, just create a new one
-	if (buffers.size() == 0)
-		buffers.emplace_back(createEmptyBuffers(VERTS_PER_BATCH * sizeof(Vertex)));
-	
-	// The partition of the vector vertex to what the buffer can hold
-	std::vector<Vertex> vertex_partition;
+MarchingCubes::ExtractStats MarchingCubes::extract_slices(SliceSampler sampler, float isovalue, const Lattice& lattice,
+	Options options) {
 
-	// Add as many vertices as we can, until the buffer is fully occupied and then make a new buffer if so.
-	size_t partition_bytes = 0;
-	for (int i = lastIndex; i < vertices.size(); i++) {
-		vertex_partition.emplace_back(vertices[i]);
-		partition_bytes = vertex_partition.size() * sizeof(Vertex);
+	unsigned threads = worker_count(options);
+	size_t evaluations = field_evals;
+	settle_bricks();
 
-		// Buffer is ready to be full, time fill it, and make a new one.
-		if (buffer_bytes_occupied+partition_bytes >= BYTES_PER_BATCH) {
-			glBindVertexArray(buffers.back().VAO);
-			glBindBuffer(GL_ARRAY_BUFFER, buffers.back().VBO);
-			glBufferSubData(GL_ARRAY_BUFFER, buffer_bytes_occupied,
-				partition_bytes, &vertex_partition[0]);
+	auto start = std::chrono::steady_clock::now();
+	start_job(options.job, lattice, start);
 
-			buffers.back().vert_count += vertex_partition.size();
-			buffers.emplace_back(createEmptyBuffers(BYTES_PER_BATCH));
+	bool complete = true;
+	if (!streamed_extraction(sampler, isovalue, lattice, threads, options, complete))
+		complete = marching_cubes(sampler, isovalue, lattice, threads, options);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
 
-			vertex_partition.clear();
+	ExtractStats stats = report_extraction(lattice, evaluations, elapsed.count(), threads, options, complete);
+	if (options.job)
+		options.job->finished = true;
+	return stats;
+}
+
+void MarchingCubes::clear(Options options) {
+	vertices.clear();
+	indices.clear();
+	store = BrickStore();
+
+	// The render thread drops its copy once it reaches this block
+	if (options.publish) {
+		VertexBlock* reset = block_pool.acquire();
+		reset->reset = true;
+		published.push(reset);
+	}
+}
+
+void MarchingCubes::cache_slices(SliceSampler sampler, const Lattice& lattice, Options options,
+	std::function<float(float, float, float)> field) {
+	unsigned threads = worker_count(options);
+	auto start = std::chrono::steady_clock::now();
+
+	settle_bricks();
+	grid.lattice = lattice;
+	grid.slices.clear();
+	grid.pyramid = BrickPyramid();
+	grid.sampler = sampler;
+	grid.field = field;
+	if (lattice.empty())
+		return;
+
+	// Slices and then brick layers are independent, so hand them out to the threads one at a time
+	const size_t slice_count = lattice.points(2);
+	grid.slices.resize(slice_count);
+	std::atomic<size_t> next_slice{ 0 };
+	run_workers(threads, [&]() {
+		for (size_t k = next_slice++; k < slice_count; k = next_slice++) {
+			grid.slices[k].resize(lattice.points(0) * lattice.points(1));
+			sample_slice(sampler, lattice, k, grid.slices[k]);
 		}
+	});
+
+	grid.pyramid.resize(lattice.points(0), lattice.points(1), lattice.points(2));
+	std::atomic<size_t> next_layer{ 0 };
+	run_workers(threads, [&]() {
+		for (size_t bk = next_layer++; bk < grid.pyramid.layers(); bk = next_layer++)
+			grid.pyramid.build_layer(grid.slices, bk);
+	});
+	grid.pyramid.build_levels();
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	std::cout << "Cached " << slice_count * lattice.points(0) * lattice.points(1) << " samples in " << elapsed.count() << "s, "
+		<< grid.pyramid.brick_count() << " bricks" << std::endl;
+}
+
+MarchingCubes::ExtractStats MarchingCubes::extract_cached(float isovalue, Options options) {
+	if (grid.slices.empty()) {
+		std::cout << "Nothing cached to extract from, cache() the field first" << std::endl;
+		return ExtractStats();
 	}
 
-	//Now, add whatever remains in the partition into the buffer
-	if (vertex_partition.size() > 0) {
-		glBindVertexArray(buffers.back().VAO);
-		glBindBuffer(GL_ARRAY_BUFFER, buffers.back().VBO);
-		glBufferSubData(GL_ARRAY_BUFFER, buffer_bytes_occupied,
-			partition_bytes, &vertex_partition[0]);
+	unsigned threads = worker_count(options);
+	auto start = std::chrono::steady_clock::now();
+	start_job(options.job, grid.lattice, start);
 
-		buffers.back().vert_count += vertex_partition.size();
-		buffer_bytes_occupied += partition_bytes;
+	// The new surface replaces the old one
+	clear(options);
+
+	// A triangle list's size is known from the cases alone, so it's counted first and written in place. Welded
+	// vertices depend on the neighbouring cells too, so indexed meshes are merged slab by slab as usual.
+	grid.pyramid.find_active(isovalue, grid.active);
+	bool complete = true;
+	if (!streamed_extraction(MarchingCubes::SliceSampler(), isovalue, grid.lattice, threads, options, complete, &grid)) {
+		if (options.indexed)
+			complete = marching_cubes(MarchingCubes::SliceSampler(), isovalue, grid.lattice, threads, options, &grid);
+		else
+			complete = two_pass_cached(isovalue, threads, options);
 	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << "Marched " << grid.active.count << " of " << grid.pyramid.brick_count() << " bricks" << std::endl;
+	ExtractStats stats = report_extraction(grid.lattice, field_evals, elapsed.count(), threads, options, complete);
+	if (options.job)
+		options.job->finished = true;
+	return stats;
+}
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+// Cells of brick node of the cached grid
+CellBox brick_cells(size_t node) {
+	const size_t* bricks = grid.active.bricks;
+	size_t bk = node / (bricks[0] * bricks[1]);
+	size_t bi = node / bricks[1] % bricks[0];
+	size_t bj = node % bricks[1];
 
-	lastIndex = vertices.size(); // The index of the next element to be added (Since its [begin, end) in vector splitting)
+	CellBox box = { { bi * BRICK_CELLS, bj * BRICK_CELLS, bk * BRICK_CELLS }, {} };
+	for (int axis = 0; axis < 3; axis++)
+		box.end[axis] = std::min(grid.lattice.cells[axis], box.begin[axis] + BRICK_CELLS);
+	return box;
 }
 
-void MarchingCubes::render(ShaderProgram& shader, glm::mat4 mvp) {
+// Level of detail for brick node, from its distance to the LOD eye
+int brick_level(size_t node) {
+	const MarchingCubes::LOD& lod = store.lod;
+	if (!(lod.distance > 0))
+		return 0;
 
-	glUseProgram(shader.ID);
-	shader.setUniformMatrix4fv("mvp", mvp);
-	shader.setUniform3fv("modelColor", base_color);
+	CellBox cells = brick_cells(node);
+	glm::vec3 centre;
+	for (int axis = 0; axis < 3; axis++)
+		centre[axis] = (grid.lattice.coord(axis, cells.begin[axis]) + grid.lattice.coord(axis, cells.end[axis])) / 2;
+	float distance = glm::length(centre - lod.eye);
 
-	// Draw each buffer that we are able
-	for (int i = 0; i < buffers.size(); i++) {
-		glBindVertexArray(buffers[i].VAO);
-		glDrawArrays(GL_TRIANGLES, 0, buffers[i].vert_count);
-		glBindVertexArray(0);
+	// Coarse cells can't be bigger than a brick, and have to fit a brick cut short by the end of the lattice exactly
+	int level = 0;
+	for (float reach = lod.distance; distance >= reach && level < std::min(lod.max_level, 3); reach *= 2)
+		level++;
+	for (int axis = 0; axis < 3; axis++)
+		while ((cells.end[axis] - cells.begin[axis]) % ((size_t)1 << level) != 0)
+			level--;
+	return level;
+}
+
+// Marches brick node on every 2^level-th lattice point of the cached grid. The points are copied into a small grid
+// of their own, with a coarse point either side of the brick where there is one for gradient normals to difference.
+void march_coarse(size_t node, int level, SlabMesh& out) {
+	const MarchingCubes::Lattice& fine = grid.lattice;
+	const size_t s = (size_t)1 << level;
+	CellBox cells = brick_cells(node);
+
+	SampleGrid coarse;
+	CellBox box;
+	size_t origin[3];
+	for (int axis = 0; axis < 3; axis++) {
+		size_t before = cells.begin[axis] >= s ? 1 : 0;
+		size_t after = cells.end[axis] + s <= fine.cells[axis] ? 1 : 0;
+		size_t count = (cells.end[axis] - cells.begin[axis]) / s;
+		origin[axis] = cells.begin[axis] - before * s;
+		coarse.lattice.cells[axis] = before + count + after;
+		coarse.lattice.min[axis] = fine.coord(axis, origin[axis]);
+		coarse.lattice.stepsize[axis] = fine.stepsize[axis] * s;
+		box.begin[axis] = before;
+		box.end[axis] = before + count;
 	}
-}
\ No newline at end of file
+
+	const size_t x_points = coarse.lattice.points(0), y_points = coarse.lattice.points(1);
+	coarse.slices.resize(coarse.lattice.points(2));
+	for (size_t k = 0; k < coarse.slices.size(); k++) {
+		const std::vector<float>& slice = grid.slices[origin[2] + k * s];
+		coarse.slices[k].resize(x_points * y_points);
+		for (size_t i = 0; i < x_points; i++)
+			for (size_t j = 0; j < y_points; j++)
+				coarse.slices[k][i * y_points + j] = slice[(origin[0] + i * s) * fine.points(1) + origin[1] + j * s];
+	}
+
+	// The brick is known to be active, so march all of it
+	ActiveBricks& active = coarse.active;
+	for (int axis = 0; axis < 3; axis++)
+		active.bricks[axis] = (coarse.lattice.cells[axis] + BRICK_CELLS - 1) / BRICK_CELLS;
+	active.brick.assign(active.bricks[0] * active.bricks[1] * active.bricks[2], 1);
+	active.row.assign(active.bricks[2] * active.bricks[0], 1);
+	active.layer.assign(active.bricks[2], 1);
+	active.count = active.brick.size();
+
+	// Same options as the full resolution bricks, so the decider settles the coarse cells' faces too
+	march_slab(MarchingCubes::SliceSampler(), store.isovalue, coarse.lattice, box, store.options, out, &coarse);
+}
+
+// Hangs a skirt from every edge of brick node's surface lying on a face shared with a finer brick, pushed back
+// under the surface by depth, to cover the crack between the two bricks' surfaces
+void add_skirts(size_t node, float depth, MarchingCubes::Mesh& mesh) {
+	const MarchingCubes::Lattice& lattice = grid.lattice;
+	const size_t* bricks = grid.active.bricks;
+	const size_t brick[3] = { node / bricks[1] % bricks[0], node % bricks[1], node / (bricks[0] * bricks[1]) };
+	CellBox cells = brick_cells(node);
+
+	// Coordinate of each face with a finer neighbour, 6 of them in the order -x, +x, -y, +y, -z, +z
+	bool skirted[6] = {};
+	float face[6];
+	bool any = false;
+	for (int f = 0; f < 6; f++) {
+		int axis = f / 2, side = f % 2;
+		if (side == 0 ? brick[axis] == 0 : brick[axis] + 1 == bricks[axis])
+			continue; // Edge of the lattice, nothing to meet
+
+		size_t neighbour[3] = { brick[0], brick[1], brick[2] };
+		neighbour[axis] = side == 0 ? neighbour[axis] - 1 : neighbour[axis] + 1;
+		size_t n = (neighbour[2] * bricks[0] + neighbour[0]) * bricks[1] + neighbour[1];
+		skirted[f] = store.levels[n] < store.levels[node];
+		face[f] = lattice.coord(axis, side == 0 ? cells.begin[axis] : cells.end[axis]);
+		any |= skirted[f];
+	}
+	if (!any)
+		return;
+
+	// The coarse lattice's coordinates can be off from the fine one's in the last bits
+	const float tolerance = 1e-3f * lattice.stepsize.x;
+	auto on_face = [&](const glm::vec3& p, int f) { return std::abs(p[f / 2] - face[f]) <= tolerance; };
+
+	const bool indexed = !mesh.indices.empty();
+	const size_t triangles = (indexed ? mesh.indices.size() : mesh.vertices.size()) / 3;
+	for (size_t t = 0; t < triangles; t++)
+		for (int e = 0; e < 3; e++) {
+			size_t a = 3 * t + e, b = 3 * t + (e + 1) % 3;
+			if (indexed) {
+				a = mesh.indices[a];
+				b = mesh.indices[b];
+			}
+			Vertex va = mesh.vertices[a], vb = mesh.vertices[b];
+
+			bool skirt = false;
+			for (int f = 0; f < 6 && !skirt; f++)
+				skirt = skirted[f] && on_face(va.position, f) && on_face(vb.position, f);
+			if (!skirt)
+				continue;
+
+			// A quad from the edge down to a copy of it pushed in along the normals
+			Vertex da(va.position - va.normal * depth, va.normal), db(vb.position - vb.normal * depth, vb.normal);
+			if (indexed) {
+				uint32_t first = (uint32_t)mesh.vertices.size();
+				mesh.vertices.push_back(da);
+				mesh.vertices.push_back(db);
+				const uint32_t quad[6] = { (uint32_t)a, (uint32_t)b, first + 1, (uint32_t)a, first + 1, first };
+				mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+			}
+			else {
+				const Vertex quad[6] = { va, vb, db, va, db, da };
+				mesh.vertices.insert(mesh.vertices.end(), quad, quad + 6);
+			}
+		}
+}
+
+// Marches the given bricks of the cached grid into the brick store, then publishes them in order
+void march_bricks(const std::vector<size_t>& nodes, unsigned threads) {
+	const MarchingCubes::Options& options = store.options;
+	std::atomic<size_t> next{ 0 };
+	run_workers(threads, [&]() {
+		for (size_t n = next++; n < nodes.size(); n = next++) {
+			SlabMesh brick;
+			int level = store.levels[nodes[n]];
+			if (grid.active.brick[nodes[n]] && level > 0)
+				march_coarse(nodes[n], level, brick);
+			else if (grid.active.brick[nodes[n]])
+				march_slab(MarchingCubes::SliceSampler(), store.isovalue, grid.lattice, brick_cells(nodes[n]), options,
+						   brick, &grid);
+
+			// Without the neighbouring bricks' faces, a brick's summed normals are as done as they'll get
+			if (options.indexed && !options.gradient_normals)
+				for (Vertex& v : brick.vertices)
+					finish_normal(v);
+
+			// Skirts as deep as a coarse cell, which is as far apart as the two surfaces can be
+			if (level > 0)
+				add_skirts(nodes[n], (float)(1 << level) * grid.lattice.stepsize.x, brick);
+
+			MarchingCubes::Mesh& mesh = store.bricks[nodes[n]];
+			mesh.vertices.swap(brick.vertices);
+			mesh.indices.swap(brick.indices);
+		}
+	});
+
+	if (options.publish)
+		for (size_t node : nodes)
+			publish(store.bricks[node], (uint32_t)node);
+	store.gathered = false;
+}
+
+MarchingCubes::ExtractStats MarchingCubes::extract_bricks(float isovalue, Options options, LOD lod) {
+	if (grid.slices.empty()) {
+		std::cout << "Nothing cached to extract from, cache() the field first" << std::endl;
+		return ExtractStats();
+	}
+
+	unsigned threads = worker_count(options);
+	auto start = std::chrono::steady_clock::now();
+
+	// The new surface replaces the old one
+	clear(options);
+	store.bricks.resize(grid.pyramid.brick_count());
+	store.isovalue = isovalue;
+	store.options = options;
+	store.lod = lod;
+	store.active = true;
+
+	grid.pyramid.find_active(isovalue, grid.active);
+	store.levels.resize(store.bricks.size());
+	for (size_t node = 0; node < store.levels.size(); node++)
+		store.levels[node] = (uint8_t)brick_level(node);
+
+	std::vector<size_t> nodes;
+	for (size_t node = 0; node < grid.active.brick.size(); node++)
+		if (grid.active.brick[node])
+			nodes.push_back(node);
+	march_bricks(nodes, threads);
+	gather_bricks();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << "Marched " << grid.active.count << " of " << grid.pyramid.brick_count() << " bricks" << std::endl;
+	return report_extraction(grid.lattice, field_evals, elapsed.count(), threads, options);
+}
+
+// Cells, triangles and vertices of the given bricks of the brick store
+MarchingCubes::ExtractStats brick_stats(const std::vector<size_t>& nodes) {
+	MarchingCubes::ExtractStats stats;
+	for (size_t node : nodes) {
+		const MarchingCubes::Mesh& mesh = store.bricks[node];
+		CellBox cells = brick_cells(node);
+		stats.cells += (cells.end[0] - cells.begin[0]) * (cells.end[1] - cells.begin[1]) * (cells.end[2] - cells.begin[2]);
+		stats.triangles += (mesh.indices.empty() ? mesh.vertices.size() : mesh.indices.size()) / 3;
+		stats.vertices += mesh.vertices.size();
+	}
+	return stats;
+}
+
+MarchingCubes::ExtractStats MarchingCubes::invalidate(const AABB& box) {
+	if (!store.active) {
+		std::cout << "Nothing to invalidate, extract_bricks() first" << std::endl;
+		return ExtractStats();
+	}
+
+	const Lattice& lattice = grid.lattice;
+	unsigned threads = worker_count(store.options);
+	size_t evaluations = field_evals;
+	auto start = std::chrono::steady_clock::now();
+
+	// Lattice points inside the box, from first to last along each axis
+	size_t first[3], last[3];
+	for (int axis = 0; axis < 3; axis++) {
+		float lo = std::ceil((box.min[axis] - lattice.min[axis]) / lattice.stepsize[axis]);
+		float hi = std::floor((box.max[axis] - lattice.min[axis]) / lattice.stepsize[axis]);
+		if (hi < 0 || lo > (float)(lattice.points(axis) - 1) || lo > hi)
+			return ExtractStats(); // No samples in it to change
+		first[axis] = (size_t)std::max(0.0f, lo);
+		last[axis] = std::min(lattice.points(axis) - 1, (size_t)hi);
+	}
+
+	// Resample them, point by point when there's a field to call, otherwise whole slices at a time
+	std::atomic<size_t> next_slice{ first[2] };
+	run_workers(threads, [&]() {
+		for (size_t k = next_slice++; k <= last[2]; k = next_slice++) {
+			if (!grid.field) {
+				sample_slice(grid.sampler, lattice, k, grid.slices[k]);
+				continue;
+			}
+
+			const float z = lattice.coord(2, k);
+			for (size_t i = first[0]; i <= last[0]; i++)
+				for (size_t j = first[1]; j <= last[1]; j++)
+					grid.slices[k][i * lattice.points(1) + j] = grid.field(lattice.coord(0, i), lattice.coord(1, j), z);
+			field_evals += (last[0] - first[0] + 1) * (last[1] - first[1] + 1);
+		}
+	});
+
+	// Bricks that have any of those points, or next to them since gradient normals difference neighbours. A point on
+	// a face between bricks is in the bricks on both sides. A coarse brick reads points a whole coarse step outside
+	// itself, for the padding round its grid, so it can be that far from them.
+	size_t reach = 1;
+	for (uint8_t level : store.levels)
+		reach = std::max(reach, (size_t)1 << level);
+	size_t brick_first[3], brick_last[3];
+	for (int axis = 0; axis < 3; axis++) {
+		size_t lo = first[axis] > reach ? first[axis] - reach : 0;
+		size_t hi = std::min(lattice.points(axis) - 1, last[axis] + reach);
+		brick_first[axis] = lo > 0 ? (lo - 1) / BRICK_CELLS : 0;
+		brick_last[axis] = std::min(grid.active.bricks[axis] - 1, hi / BRICK_CELLS);
+	}
+
+	grid.pyramid.rebuild(grid.slices, brick_first, brick_last);
+	grid.pyramid.update_active(store.isovalue, brick_first, brick_last, grid.active);
+
+	std::vector<size_t> nodes;
+	const size_t* bricks = grid.active.bricks;
+	for (size_t bk = brick_first[2]; bk <= brick_last[2]; bk++)
+		for (size_t bi = brick_first[0]; bi <= brick_last[0]; bi++)
+			for (size_t bj = brick_first[1]; bj <= brick_last[1]; bj++)
+				nodes.push_back((bk * bricks[0] + bi) * bricks[1] + bj);
+	march_bricks(nodes, threads);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	ExtractStats stats = brick_stats(nodes);
+	stats.field_evaluations = field_evals - evaluations;
+	stats.seconds = elapsed.count();
+
+	std::cout << "Re-marched " << nodes.size() << " bricks, " << stats.triangles << " triangles, in " << stats.seconds
+		<< "s after resampling " << stats.field_evaluations << " points" << std::endl;
+	return stats;
+}
+
+MarchingCubes::ExtractStats MarchingCubes::update_lod(glm::vec3 eye) {
+	if (!store.active) {
+		std::cout << "No LOD to update, extract_bricks() first" << std::endl;
+		return ExtractStats();
+	}
+
+	unsigned threads = worker_count(store.options);
+	auto start = std::chrono::steady_clock::now();
+	store.lod.eye = eye;
+
+	// Bricks changing level, and their neighbours since whether they need skirts depends on it
+	const size_t* bricks = grid.active.bricks;
+	std::vector<uint8_t> redo(store.levels.size(), 0);
+	for (size_t node = 0; node < store.levels.size(); node++) {
+		uint8_t level = (uint8_t)brick_level(node);
+		if (level == store.levels[node])
+			continue;
+		store.levels[node] = level;
+
+		const size_t brick[3] = { node / bricks[1] % bricks[0], node % bricks[1], node / (bricks[0] * bricks[1]) };
+		redo[node] = 1;
+		for (int axis = 0; axis < 3; axis++) {
+			size_t stride = axis == 1 ? 1 : axis == 0 ? bricks[1] : bricks[0] * bricks[1];
+			if (brick[axis] > 0)
+				redo[node - stride] = 1;
+			if (brick[axis] + 1 < bricks[axis])
+				redo[node + stride] = 1;
+		}
+	}
+
+	// Bricks with no surface have nothing to redo
+	std::vector<size_t> nodes;
+	for (size_t node = 0; node < redo.size(); node++)
+		if (redo[node] && grid.active.brick[node])
+			nodes.push_back(node);
+	if (nodes.empty())
+		return ExtractStats();
+	march_bricks(nodes, threads);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	ExtractStats stats = brick_stats(nodes);
+	stats.seconds = elapsed.count();
+	std::cout << "Re-marched " << nodes.size() << " bricks for LOD, " << stats.triangles << " triangles, in "
+		<< stats.seconds << "s" << std::endl;
+	return stats;
+}
+
+MarchingCubes::ExtractStats MarchingCubes::extract(std::function<float(float, float, float)> f, float isovalue,
+	float min, float max, float stepsize, Options options) {
+	return extract<std::function<float(float, float, float)>>(f, isovalue, min, max, stepsize, options);
+}
+
+size_t MarchingCubes::write_ply(const std::string& path, PLYFormat format) {
+	gather_bricks();
+	return writeToPLY(vertices, indices, path, format);
+}
+
+bool MarchingCubes::save(std::function<float(float, float, float)> f, float isovalue, float stepsize, Options options,
+	const std::string& path) {
+	std::cout << "Field evaluations: " << field_evals << std::endl;
+	gather_bricks();
+
+	// Already written as it was extracted, and not kept around to measure
+	if (!options.stream_to.empty()) {
+		if (options.measure_error)
+			std::cout << "A streamed mesh isn't kept in memory, so its error can't be measured" << std::endl;
+		if (streamed.bytes == 0) {
+			std::cout << "Couldn't write to " << options.stream_to << std::endl;
+			return false;
+		}
+		std::cout << "Streamed " << streamed.bytes / (1024.0 * 1024.0) << " MB to " << options.stream_to << std::endl;
+		return true;
+	}
+
+	if (options.measure_error) {
+		SurfaceError error = surface_error(f, isovalue, vertices);
+		std::cout << "Distance to surface: mean " << error.mean << " (" << 100 * error.mean / stepsize
+			<< "% of a cell), max " << error.max << " (" << 100 * error.max / stepsize << "% of a cell)" << std::endl;
+	}
+
+	std::cout << "Writing vertices to file..." << std::endl;
+	// When vertices are finished, we can write to a PLY file.
+	auto start = std::chrono::steady_clock::now();
+	size_t bytes = write_ply(path, options.ply_format);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	if (bytes == 0) {
+		std::cout << "Couldn't write to " << path << std::endl;
+		return false;
+	}
+
+	double megabytes = bytes / (1024.0 * 1024.0);
+	std::cout << "Done writing to file, " << megabytes << " MB at " << megabytes / elapsed.count() << " MB/s" << std::endl;
+	return true;
+}
+
+MarchingCubes::SurfaceError MarchingCubes::surface_error(std::function<float(float, float, float)> f, float isovalue,
+	const VertexChunks& vertices) {
+
+	// Step for the central differences, small against any sensible stepsize but well clear of float noise
+	const float h = 1e-3f;
+
+	SurfaceError error;
+	double total = 0;
+	for (size_t n = 0; n < vertices.size(); n++) {
+		const glm::vec3& p = vertices[n].position;
+		glm::vec3 gradient(f(p.x + h, p.y, p.z) - f(p.x - h, p.y, p.z),
+						   f(p.x, p.y + h, p.z) - f(p.x, p.y - h, p.z),
+						   f(p.x, p.y, p.z + h) - f(p.x, p.y, p.z - h));
+		gradient /= 2 * h;
+
+		// First order distance to the surface, f's offset from isovalue over how fast f is changing there
+		float slope = glm::length(gradient);
+		if (slope == 0)
+			continue;
+		double distance = std::abs(f(p.x, p.y, p.z) - isovalue) / slope;
+
+		total += distance;
+		error.max = std::max(error.max, distance);
+		error.samples++;
+	}
+
+	if (error.samples > 0)
+		error.mean = total / error.samples;
+	return error;
+}
+
+MarchingCubes::ManifoldReport MarchingCubes::check_manifold(const Lattice& lattice) {
+	gather_bricks();
+
+	// Vertex ids of the triangles. A triangle list repeats shared vertices, so those get one id per distinct position.
+	std::vector<uint32_t> ids;
+	if (!indices.empty()) {
+		ids.reserve(indices.size());
+		indices.for_each_run(0, indices.size(), [&](const uint32_t* run, size_t count) {
+			ids.insert(ids.end(), run, run + count);
+		});
+	}
+	else {
+		// Compared by value, with + 0 turning -0 into 0 so the two are the same position
+		std::vector<std::pair<std::array<float, 3>, uint32_t>> positions(vertices.size());
+		for (size_t v = 0; v < vertices.size(); v++) {
+			const glm::vec3& position = vertices[v].position;
+			positions[v].first = { position.x + 0.0f, position.y + 0.0f, position.z + 0.0f };
+			positions[v].second = (uint32_t)v;
+		}
+		std::sort(positions.begin(), positions.end());
+
+		ids.resize(vertices.size());
+		uint32_t id = 0;
+		for (size_t p = 0; p < positions.size(); p++) {
+			if (p > 0 && positions[p].first != positions[p - 1].first)
+				id++;
+			ids[positions[p].second] = id;
+		}
+	}
+
+	// Every edge of every triangle, as its two ids lowest first. Shared edges end up next to each other once sorted.
+	// Edges with both ends at one position are only counted, they don't join anything up.
+	ManifoldReport report;
+	std::vector<uint64_t> edges;
+	edges.reserve(ids.size());
+	for (size_t t = 0; t + 2 < ids.size(); t += 3)
+		for (int e = 0; e < 3; e++) {
+			uint32_t a = ids[t + e], b = ids[t + (e + 1) % 3];
+			if (a == b)
+				report.degenerate_edges++;
+			else
+				edges.push_back((uint64_t)std::min(a, b) << 32 | std::max(a, b));
+		}
+	std::sort(edges.begin(), edges.end());
+
+	// Where an open edge runs along a side of the lattice, from one of its vertices' positions
+	std::vector<glm::vec3> position_of(ids.empty() ? 0 : *std::max_element(ids.begin(), ids.end()) + 1);
+	for (size_t v = 0; v < ids.size(); v++)
+		position_of[ids[v]] = indices.empty() ? vertices[v].position : vertices[ids[v]].position;
+	auto on_side = [&](uint32_t a, uint32_t b) {
+		for (int axis = 0; axis < 3; axis++) {
+			const float tolerance = 1e-4f * lattice.stepsize[axis];
+			for (float side : { lattice.min[axis], lattice.coord(axis, lattice.cells[axis]) })
+				if (std::abs(position_of[a][axis] - side) <= tolerance && std::abs(position_of[b][axis] - side) <= tolerance)
+					return true;
+		}
+		return false;
+	};
+
+	for (size_t e = 0; e < edges.size(); ) {
+		size_t run = 1;
+		while (e + run < edges.size() && edges[e + run] == edges[e])
+			run++;
+
+		report.edges++;
+		if (run > 2)
+			report.non_manifold_edges++;
+		else if (run == 1 && on_side((uint32_t)(edges[e] >> 32), (uint32_t)edges[e]))
+			report.domain_edges++;
+		else if (run == 1)
+			report.boundary_edges++;
+		e += run;
+	}
+	return report;
+}
+
+double MarchingCubes::Job::progress() const {
+	size_t total = cells_total;
+	return total > 0 ? std::min(1.0, (double)cells_done / total) : 0;
+}
+
+double MarchingCubes::Job::seconds() const {
+	int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+	return started > 0 ? (now - started) * 1e-9 : 0;
+}
+
+double MarchingCubes::Job::eta() const {
+	double done = progress();
+	if (done <= 0)
+		return -1;
+	return seconds() * (1 - done) / done;
+}
+
+size_t MarchingCubes::field_evaluations() {
+	return field_evals;
+}
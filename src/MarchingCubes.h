@@ -1,23 +1,240 @@
 #ifndef MARCHINGCUBES_H
 #define MARCHINGCUBES_H
 #include <vector>
+#include <cstdint>
 #include <functional>
-#include <glm/mat4x4.hpp>
-#include "ShaderProgram.h"
+#include <type_traits>
+#include <utility>
+#include <string>
+#include <atomic>
+#include <glm/vec3.hpp>
+#include "ChunkedArray.h"
 
+// Extraction and PLY output. Doesn't touch GL, MeshRenderer.h has the drawing side.
 namespace MarchingCubes {
 
-	extern glm::vec3 base_color;
+	enum class PLYFormat {
+		Ascii,
+		Binary  // binary_little_endian 1.0, much smaller and faster to write and load
+	};
+
+	// Progress of an extraction and a way of stopping it, for other threads to keep an eye on it through Options::job.
+	// All of it can be read from any thread while the extraction runs, without taking a lock.
+	struct Job {
+		std::atomic<bool> cancelled{ false }; // See cancel(). Never cleared, a job is good for one extraction.
+		std::atomic<bool> finished{ false };  // Set as the extraction returns, whether or not it was cancelled
+		std::atomic<size_t> cells_done{ 0 };  // Marched so far, or read back from a checkpoint
+		std::atomic<size_t> cells_total{ 0 };
+		std::atomic<size_t> triangles{ 0 };   // Merged into the mesh so far
+		std::atomic<int64_t> started{ 0 };    // steady_clock time the extraction started, in nanoseconds
+
+		// Stops the extraction as soon as the slabs being marched are done, keeping what's been merged so far
+		void cancel() { cancelled = true; }
+
+		double progress() const; // Fraction of the cells done, 0 to 1
+		double seconds() const;  // Since the extraction started
+		double eta() const;      // Seconds left at the rate so far, or -1 until there is a rate
+	};
+
+	struct Options {
+		unsigned threads = 0; // Extraction worker threads, 0 uses one per hardware thread
+		bool indexed = false; // Weld vertices shared between triangles and output an index buffer, with smoothed normals
+		PLYFormat ply_format = PLYFormat::Ascii;
+		bool interpolate = true;     // Place vertices where the field crosses isovalue instead of at edge midpoints
+		bool measure_error = false;  // Report how far the mesh's vertices are from the true surface
+		bool gradient_normals = false; // Smooth normals from the field's gradient, rather than from the faces
+		bool simd = true;            // Classify cells with AVX2 or SSE2 when the CPU has them
+		bool publish = true;         // Hand the mesh to update() as it's extracted, turn off when nothing is rendering it
+		std::string stream_to;       // PLY file to write the mesh to as it's extracted, instead of keeping it in memory
+		size_t memory_cap = 0;       // Bytes of extracted triangles allowed to queue up waiting to be merged, 0 for no limit
+		bool asymptotic_decider = false; // Settle ambiguous faces consistently so the mesh is watertight, see Topology.h
+		Job* job = nullptr;          // Progress and cancelling for extract_slices(), extract() and extract_cached(), left alone if null
+		std::string checkpoint;      // File to save finished slabs in, so an extract_slices() that's killed can pick up where it stopped
+	};
+
+	// Lattice an extraction runs over. Cell counts are worked out once, and lattice point i along an axis sits at
+	// min + i * stepsize, so every point's position is fixed by its index alone and cells can be split up between
+	// threads, cached and revisited by index.
+	struct Lattice {
+		size_t cells[3] = { 0, 0, 0 }; // nx, ny, nz
+		glm::vec3 min = glm::vec3(0);
+		glm::vec3 stepsize = glm::vec3(0);
+
+		Lattice() = default;
+		// The cube [min, max] on every axis, with enough cells to cover it
+		Lattice(float min, float max, float stepsize);
+		// nx by ny by nz cells from min, e.g. the voxels of a volume
+		Lattice(size_t nx, size_t ny, size_t nz, glm::vec3 min, glm::vec3 stepsize);
+
+		size_t points(int axis) const { return cells[axis] + 1; }
+		size_t cell_count() const { return cells[0] * cells[1] * cells[2]; }
+		bool empty() const { return cell_count() == 0; }
+		float coord(int axis, size_t i) const { return min[axis] + (float)i * stepsize[axis]; }
+	};
+
+	// Fills slice with the field at every lattice point of z-plane k: slice[i * lattice.points(1) + j] is the value
+	// at lattice point (i, j, k). Called for one slice at a time from several threads at once.
+	typedef std::function<void(const Lattice& lattice, size_t k, std::vector<float>& slice)> SliceSampler;
+
+	// What an extraction did, for reporting and benchmarking
+	struct ExtractStats {
+		size_t cells = 0;      // In the whole lattice, whether or not they were visited
+		size_t triangles = 0;
+		size_t vertices = 0;
+		size_t field_evaluations = 0;
+		double seconds = 0;
+		bool cancelled = false; // Stopped through Options::job, so the mesh is only part of the surface
+	};
+
+	// Extracts the surface into the mesh that update() uploads and save() writes out, adding it to whatever
+	// was extracted before.
+	//
+	// With Options::stream_to, the mesh is written to that PLY file as slabs of it are finished and then dropped,
+	// rather than added to the mesh, so memory stays flat however big the surface is. Slabs are kept thin, and
+	// Options::memory_cap stops threads running ahead of the writer, so the only triangles in memory are the
+	// slabs being marched and at most memory_cap bytes of finished ones.
+	//
+	// With Options::checkpoint, every slab is appended to that file as it's merged. If the file is already there from
+	// an extraction of the same lattice, isovalue and options that didn't finish, its slabs are read back instead of
+	// marched again, and only the rest of the lattice is. The field can't be checked, so a checkpoint left over from
+	// a different field has to be deleted by hand. The file is deleted once the extraction finishes, but kept if it's
+	// cancelled, so it can be resumed.
+	ExtractStats extract_slices(SliceSampler sampler, float isovalue, const Lattice& lattice, Options options = Options());
+
+	// Whether Field has a row(x, y, count, z, out) method for evaluating a row of samples in one call
+	template <typename Field, typename = void>
+	struct has_row : std::false_type {};
+
+	template <typename Field>
+	struct has_row<Field, std::void_t<decltype(std::declval<const Field&>().row(
+		0.0f, (const float*)nullptr, size_t(0), 0.0f, (float*)nullptr))>> : std::true_type {};
+
+	// Wraps any callable float(float x, float y, float z) up as a SliceSampler. The field is called directly in the
+	// sampling loop, so a lambda or functor gets inlined there rather than going through an indirect call per
+	// lattice point (a plain function pointer still costs one, wrap it in a lambda to avoid that).
+	// It's called from several threads at once, so it must be safe to.
+	//
+	// A field can also evaluate a whole row of y at once, e.g. with its own SIMD, by providing
+	//     void row(float x, const float* y, size_t count, float z, float* out) const;
+	// which is then called once per row in place of calling the field point by point.
+	template <typename Field>
+	SliceSampler slice_sampler(const Field& field) {
+		return [field](const Lattice& lattice, size_t k, std::vector<float>& slice) {
+			const size_t x_points = lattice.points(0), y_points = lattice.points(1);
+			const float z = lattice.coord(2, k);
+
+			// Kept per thread rather than allocated for every slice
+			thread_local std::vector<float> ys;
+			ys.resize(y_points);
+			for (size_t j = 0; j < y_points; j++)
+				ys[j] = lattice.coord(1, j);
+
+			for (size_t i = 0; i < x_points; i++) {
+				const float x = lattice.coord(0, i);
+				if constexpr (has_row<Field>::value)
+					field.row(x, ys.data(), y_points, z, &slice[i * y_points]);
+				else
+					for (size_t j = 0; j < y_points; j++)
+						slice[i * y_points + j] = field(x, ys[j], z);
+			}
+		};
+	}
+
+	// Extracts the surface of the field, see slice_sampler() for what it can be.
+	template <typename Field>
+	ExtractStats extract(const Field& field, float isovalue, float min, float max, float stepsize, Options options = Options()) {
+		return extract_slices(slice_sampler(field), isovalue, Lattice(min, max, stepsize), options);
+	}
+
+	ExtractStats extract(std::function<float(float, float, float)> f, float isovalue,
+		float min, float max, float stepsize, Options options = Options());
 
-	void init(std::function<float(float, float, float)> f, float isovalue,
-		float min, float max, float stepsize);
+	// Writes the mesh to a PLY file at path, returning the number of bytes written or 0 if it couldn't be
+	size_t write_ply(const std::string& path, PLYFormat format = PLYFormat::Ascii);
 
-	void update();
-	void render(ShaderProgram& shader, glm::mat4 mvp);
+	// Reports on the finished extraction and writes it to path, returning false if the file couldn't be written.
+	// f is only needed for Options::measure_error. A streamed extraction is already written, so this only reports
+	// on its file.
+	bool save(std::function<float(float, float, float)> f, float isovalue, float stepsize, Options options = Options(),
+		const std::string& path = "output.ply");
+
+	// Samples the whole lattice once and keeps it, along with a min/max pyramid over bricks of 8x8x8 cells, so that
+	// extract_cached() can then pull out the surface at any isovalue without evaluating the field again. Memory is
+	// 4 bytes per lattice point, so this suits sweeping through isovalues on moderate lattices.
+	// The sampler, and field if given, are kept for invalidate() to resample with. Given field, it resamples just
+	// the lattice points that changed, otherwise whole slices.
+	void cache_slices(SliceSampler sampler, const Lattice& lattice, Options options = Options(),
+		std::function<float(float, float, float)> field = nullptr);
+
+	template <typename Field>
+	void cache(const Field& field, float min, float max, float stepsize, Options options = Options()) {
+		cache_slices(slice_sampler(field), Lattice(min, max, stepsize), options, field);
+	}
+
+	// Replaces the mesh with the surface at isovalue in the cached lattice. Only bricks whose range of values
+	// straddles isovalue are marched, so it takes time in proportion to the surface's size rather than the volume's.
+	ExtractStats extract_cached(float isovalue, Options options = Options());
+
+	// Axis aligned box, e.g. around an edit to the field
+	struct AABB {
+		glm::vec3 min, max;
+	};
+
+	// Level of detail for extract_bricks(). Bricks further than distance from eye are marched on every 2nd lattice point,
+	// and one level coarser again each time the distance doubles, so far off parts of a big domain cost a fraction of
+	// the triangles. Where a brick meets a finer one, the crack between their surfaces is covered by a skirt, a strip
+	// hung from the coarser brick's edge on that face back under its surface.
+	struct LOD {
+		glm::vec3 eye = glm::vec3(0);
+		float distance = 0; // Bricks nearer than this get full resolution, 0 for no LOD
+		int max_level = 3;  // Coarsest level, a cell per 2^max_level lattice cells. Bricks are 8 cells, so at most 3.
+	};
+
+	// Same as extract_cached(), but keeps each brick's triangles apart in a brick store, and with Options::publish
+	// hands them to the renderer brick by brick, so that invalidate() can redo just the bricks an edit touches.
+	// With Options::indexed, vertices are only welded within a brick, so bricks don't share vertices along their faces.
+	ExtractStats extract_bricks(float isovalue, Options options = Options(), LOD lod = LOD());
+
+	// Moves extract_bricks()'s LOD eye, re-marching just the bricks whose level changes and their neighbours (whose
+	// skirts depend on it). Call it from the thread that extracted, like invalidate().
+	ExtractStats update_lod(glm::vec3 eye);
+
+	// For when the field has changed inside box: resamples the cached lattice points in it, re-marches the bricks
+	// they're part of at extract_bricks()'s isovalue and options, and with Options::publish swaps just those
+	// bricks' triangles on the GPU. Work is in proportion to the size of the box, not the lattice.
+	// Call it from the thread that extracted, it's the only one that can publish.
+	ExtractStats invalidate(const AABB& box);
+
+	// Edges of the mesh not shared by exactly two triangles, and ones collapsed to a point. With
+	// Options::asymptotic_decider the open, non-manifold and degenerate counts are all 0, and the surface is only open
+	// where lattice cuts it off. Triangle lists are joined up by vertex position.
+	struct ManifoldReport {
+		size_t edges = 0;
+		size_t boundary_edges = 0;     // In one triangle only, holes in the surface
+		size_t domain_edges = 0;       // In one triangle only, but on a side of lattice where the surface is cut off
+		size_t non_manifold_edges = 0; // In more than two triangles
+		size_t degenerate_edges = 0;   // Both ends at the same position, in triangles collapsed to a line or a point
+	};
+	ManifoldReport check_manifold(const Lattice& lattice);
+
+	// Throws away the extracted mesh, and with Options::publish the renderer's copy of it too. The memory the mesh was
+	// in is kept for the next extraction to fill.
+	void clear(Options options = Options());
+
+	// Extracts and saves the surface, unless the extraction's cancelled partway
+	template <typename Field>
+	void init(const Field& f, float isovalue, float min, float max, float stepsize, Options options = Options()) {
+		if (!extract(f, isovalue, min, max, stepsize, options).cancelled)
+			save(f, isovalue, stepsize, options);
+	}
+
+	// Number of times the scalar field has been sampled so far. With the sample cache this is one per lattice point.
+	size_t field_evaluations();
 
 	struct Vertex {
 		glm::vec3 position;
 		glm::vec3 normal;
+		Vertex() = default;
 		Vertex(glm::vec3 position, glm::vec3 normal) :
 			position(position), normal(normal) {}
 	};
@@ -25,6 +242,26 @@ namespace MarchingCubes {
 	struct Triangle {
 		Vertex v1, v2, v3;
 	};
+
+	// Output of an extraction. Indices are empty for a plain triangle list, where every 3 vertices are a triangle.
+	struct Mesh {
+		std::vector<Vertex> vertices;
+		std::vector<uint32_t> indices;
+	};
+
+	// What the extracted mesh is kept in, a chunk of whole triangles at a time, so it's never copied as it grows
+	typedef ChunkedArray<Vertex, 3 << 15> VertexChunks;
+
+	// Estimated distance from each vertex to the surface of f, for judging the mesh against the analytic field.
+	// Uses |f(p) - isovalue| / |grad f(p)|, which is exact for planes and spheres' distance fields.
+	struct SurfaceError {
+		double mean = 0;
+		double max = 0;
+		size_t samples = 0;
+	};
+
+	SurfaceError surface_error(std::function<float(float, float, float)> f, float isovalue,
+		const VertexChunks& vertices);
 };
 
 #endif
\ No newline at end of file
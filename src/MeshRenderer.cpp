@@ -0,0 +1,403 @@
+#include "MeshRenderer.h"
+#include "BlockQueue.h"
+#include "UploadRing.h"
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cmath>
+
+typedef MarchingCubes::Vertex Vertex;
+
+glm::vec3 MarchingCubes::base_color = glm::vec3(0, 1, 1);  // Color of the triangles drawn
+
+// Drawing triangles, so each buffer batch must have a multiple of 3 vertices. PUNISHMENT WILL COMMENCE IF THIS ISN'T OBLIGED!
+// (It's rounded down to one when a batch is made.)
+int MarchingCubes::verts_per_batch = 30000;
+// An indexed mesh averages about 6 indices per vertex (2 triangles per shared vertex)
+const int INDICES_PER_VERTEX = 6;
+
+// Batches are suballocated out of pages, big buffers that are each drawn with a couple of multi-draw calls. A whole
+// page can be one batch, so it's a multiple of 3 too.
+const size_t PAGE_VERTS = 3 << 18;
+const size_t PAGE_INDICES = INDICES_PER_VERTEX * PAGE_VERTS;
+
+// 12 byte vertex for pack_vertices(): position as 16 bit fractions of the packing box (w is padding, to keep the
+// normal 4 byte aligned) and the normal octahedral encoded into two 16 bit signed fractions
+struct PackedVertex {
+	uint16_t position[4];
+	int16_t normal[2];
+};
+static_assert(sizeof(PackedVertex) == 12, "PackedVertex should be 12 bytes");
+
+bool packed = false;
+glm::vec3 pack_min, pack_size; // Box positions are packed relative to
+
+size_t vertex_bytes() {
+	return packed ? sizeof(PackedVertex) : sizeof(Vertex);
+}
+
+// First fit allocator over a range of a buffer, merging freed ranges back into their neighbours
+class RangeAllocator {
+public:
+	explicit RangeAllocator(size_t capacity = 0) { if (capacity > 0) free[0] = capacity; }
+
+	// Finds room for count elements, returning false if there isn't a big enough gap
+	bool allocate(size_t count, size_t& offset) {
+		for (auto gap = free.begin(); gap != free.end(); ++gap)
+			if (gap->second >= count) {
+				offset = gap->first;
+				size_t left = gap->second - count;
+				free.erase(gap);
+				if (left > 0)
+					free[offset + count] = left;
+				return true;
+			}
+		return false;
+	}
+
+	void release(size_t offset, size_t count) {
+		if (count == 0)
+			return;
+		auto next = free.lower_bound(offset);
+		if (next != free.end() && offset + count == next->first) {
+			count += next->second;
+			next = free.erase(next);
+		}
+		if (next != free.begin()) {
+			auto previous = std::prev(next);
+			if (previous->first + previous->second == offset) {
+				previous->second += count;
+				return;
+			}
+		}
+		free[offset] = count;
+	}
+
+private:
+	std::map<size_t, size_t> free; // Offset to size of each gap
+};
+
+struct Page {
+	GLuint VBO = 0, EBO = 0; // The index buffer is only made once something indexed goes in
+	RangeAllocator verts, indices;
+
+	// Filled in each frame for the multi-draw calls
+	std::vector<GLint> firsts, base_vertices;
+	std::vector<GLsizei> counts, index_counts;
+	std::vector<const void*> index_offsets;
+};
+
+// A range of a page's vertices, and its indices if it's indexed. Indices are relative to the first vertex.
+struct Batch {
+	size_t page = 0;
+	size_t first_vert = 0, vert_capacity = 0, vert_count = 0;
+	size_t first_index = 0, index_capacity = 0, index_count = 0;
+};
+
+std::vector<Page> pages;
+GLuint vao = 0; // Shared by every page, which just rebinds its buffers onto it
+
+std::vector<Batch> buffers; // Batches of the mesh as a whole, filled in order
+
+// Batches of each brick of the brick store, by brick, so a re-marched brick swaps out only its own
+std::vector<std::vector<Batch>> brick_buffers;
+
+UploadRing ring; // Everything uploaded goes through here
+MarchingCubes::UploadStats last_upload;
+MarchingCubes::RenderStats last_render;
+
+// Points the shared VAO's attributes at a page's vertex buffer
+void bind_page(const Page& page) {
+	glBindBuffer(GL_ARRAY_BUFFER, page.VBO);
+
+	if (packed) {
+		// Normalized, so they come out as 0 to 1 and -1 to 1 and the shader scales them back up
+		glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)0);
+		glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, PackedVertex::normal));
+	}
+	else {
+		// Position
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+
+		// Normal
+		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Vertex::normal));
+	}
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	// The element buffer binding is part of the VAO's state, so it stays bound for drawing
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, page.EBO);
+}
+
+GLuint create_buffer(GLenum target, size_t bytes) {
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(target, buffer);
+	// It's filled in by copies from the upload ring, then drawn every frame
+	glBufferData(target, bytes, nullptr, GL_STATIC_DRAW);
+	glBindBuffer(target, 0);
+	return buffer;
+}
+
+// Suballocates a batch with room for verts vertices and indices indices, opening a new page if none has room
+Batch allocate_batch(size_t verts, size_t indices) {
+	Batch batch;
+	batch.vert_capacity = verts;
+	batch.index_capacity = indices;
+
+	for (size_t p = 0; ; p++) {
+		if (p == pages.size()) {
+			Page page;
+			page.VBO = create_buffer(GL_ARRAY_BUFFER, PAGE_VERTS * vertex_bytes());
+			page.verts = RangeAllocator(PAGE_VERTS);
+			page.indices = RangeAllocator(PAGE_INDICES);
+			pages.push_back(std::move(page));
+		}
+
+		Page& page = pages[p];
+		if (!page.verts.allocate(verts, batch.first_vert))
+			continue;
+		if (indices > 0 && !page.indices.allocate(indices, batch.first_index)) {
+			page.verts.release(batch.first_vert, verts);
+			continue;
+		}
+
+		if (indices > 0 && page.EBO == 0)
+			page.EBO = create_buffer(GL_ELEMENT_ARRAY_BUFFER, PAGE_INDICES * sizeof(uint32_t));
+		batch.page = p;
+		return batch;
+	}
+}
+
+void release(std::vector<Batch>& batches) {
+	for (const Batch& batch : batches) {
+		pages[batch.page].verts.release(batch.first_vert, batch.vert_capacity);
+		pages[batch.page].indices.release(batch.first_index, batch.index_capacity);
+	}
+	batches.clear();
+}
+
+// Deletes every batch and the pages under them, for when the mesh is replaced
+void release_buffers() {
+	for (Page& page : pages) {
+		glDeleteBuffers(1, &page.VBO);
+		if (page.EBO != 0)
+			glDeleteBuffers(1, &page.EBO);
+	}
+	pages.clear();
+	buffers.clear();
+	brick_buffers.clear();
+}
+
+int16_t snorm16(float value) {
+	return (int16_t)std::lround(glm::clamp(value, -1.0f, 1.0f) * 32767.0f);
+}
+
+// Packs count vertices into out, see PackedVertex
+void pack(const Vertex* vertices, int count, PackedVertex* out) {
+	for (int v = 0; v < count; v++) {
+		glm::vec3 position = glm::clamp((vertices[v].position - pack_min) / pack_size, 0.0f, 1.0f);
+		for (int axis = 0; axis < 3; axis++)
+			out[v].position[axis] = (uint16_t)std::lround(position[axis] * 65535.0f);
+		out[v].position[3] = 0;
+
+		// Onto the octahedron |x| + |y| + |z| = 1, with the lower half folded out over the corners of the upper
+		glm::vec3 n = vertices[v].normal;
+		float length = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+		glm::vec2 oct(0);
+		if (length > 0) {
+			n /= length;
+			oct = glm::vec2(n.x, n.y);
+			if (n.z < 0)
+				oct = glm::vec2((1 - std::abs(n.y)) * (n.x >= 0 ? 1 : -1), (1 - std::abs(n.x)) * (n.y >= 0 ? 1 : -1));
+		}
+		out[v].normal[0] = snorm16(oct.x);
+		out[v].normal[1] = snorm16(oct.y);
+	}
+}
+
+// Appends a block's vertices, and its indices rebased onto where the vertices land, to the end of a batch
+void upload(Batch& batch, const VertexBlock* block, int first, int count) {
+	const Page& page = pages[batch.page];
+	if (packed) {
+		pack(&block->vertices[first], count, (PackedVertex*)ring.reserve(count * sizeof(PackedVertex)));
+		ring.copy_to(page.VBO, (batch.first_vert + batch.vert_count) * sizeof(PackedVertex));
+	}
+	else
+		ring.upload(page.VBO, (batch.first_vert + batch.vert_count) * sizeof(Vertex), &block->vertices[first], count * sizeof(Vertex));
+
+	if (block->index_count > 0) {
+		uint32_t* indices = (uint32_t*)ring.reserve(block->index_count * sizeof(uint32_t));
+		for (int i = 0; i < block->index_count; i++)
+			indices[i] = block->indices[i] + (uint32_t)batch.vert_count;
+		ring.copy_to(page.EBO, (batch.first_index + batch.index_count) * sizeof(uint32_t));
+	}
+
+	batch.vert_count += count;
+	batch.index_count += block->index_count;
+}
+
+// Size of a new batch of the whole mesh, from verts_per_batch, but at least a block so any block fits in one
+size_t batch_verts() {
+	int verts = MarchingCubes::verts_per_batch / 3 * 3;
+	return std::min<size_t>(PAGE_VERTS, std::max(verts, VERTS_PER_BLOCK));
+}
+
+// Copies an indexed block into the current batch in one go, so its triangles never straddle two batches
+void upload_indexed(VertexBlock* block) {
+	if (buffers.size() == 0 || buffers.back().vert_count + block->count > buffers.back().vert_capacity
+		|| buffers.back().index_count + block->index_count > buffers.back().index_capacity) {
+		size_t verts = batch_verts();
+		buffers.push_back(allocate_batch(verts, std::max<size_t>(INDICES_PER_BLOCK, INDICES_PER_VERTEX * verts)));
+	}
+
+	upload(buffers.back(), block, 0, block->count);
+}
+
+// Uploads a block of one brick into a batch of its own, sized to fit. Bricks are small and mostly fit in one block.
+void upload_brick(VertexBlock* block) {
+	if (block->brick >= brick_buffers.size())
+		brick_buffers.resize(block->brick + 1);
+	std::vector<Batch>& batches = brick_buffers[block->brick];
+	if (block->replace)
+		release(batches);
+	if (block->count == 0)
+		return;
+
+	batches.push_back(allocate_batch(block->count, block->index_count));
+	upload(batches.back(), block, 0, block->count);
+}
+
+void MarchingCubes::pack_vertices(glm::vec3 min, glm::vec3 max) {
+	release_buffers();
+	packed = true;
+	pack_min = min;
+	pack_size = glm::max(max - min, glm::vec3(1e-6f));
+}
+
+void MarchingCubes::update() {
+	auto start = std::chrono::steady_clock::now();
+	ring.bytes_uploaded = 0;
+	ring.waits = 0;
+
+	// Drain every block the extractor has published since the last frame, spilling into a new batch whenever one fills up
+	for (VertexBlock* block = published.pop(); block != nullptr; block = published.pop()) {
+		if (block->reset)
+			release_buffers();
+
+		if (block->brick != NO_BRICK) {
+			upload_brick(block);
+			continue;
+		}
+
+		if (block->index_count > 0) {
+			upload_indexed(block);
+			continue;
+		}
+
+		int uploaded = 0;
+		while (uploaded < block->count) {
+			if (buffers.size() == 0 || buffers.back().vert_count == buffers.back().vert_capacity)
+				buffers.push_back(allocate_batch(batch_verts(), 0));
+
+			Batch& batch = buffers.back();
+			int count = std::min(block->count - uploaded, (int)(batch.vert_capacity - batch.vert_count));
+			upload(batch, block, uploaded, count);
+			uploaded += count;
+		}
+	}
+
+	ring.end_frame();
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	last_upload.milliseconds = elapsed.count();
+	last_upload.bytes = ring.bytes_uploaded;
+	last_upload.waits = ring.waits;
+	last_upload.persistent = ring.persistent();
+}
+
+void MarchingCubes::shutdown() {
+	release_buffers();
+	ring.release();
+	if (vao != 0)
+		glDeleteVertexArrays(1, &vao);
+	vao = 0;
+}
+
+MarchingCubes::UploadStats MarchingCubes::upload_stats() {
+	return last_upload;
+}
+
+MarchingCubes::RenderStats MarchingCubes::render_stats() {
+	return last_render;
+}
+
+// Adds a batch to its page's draws for this frame
+void queue_draw(const Batch& batch) {
+	if (batch.vert_count == 0)
+		return;
+
+	Page& page = pages[batch.page];
+	if (batch.index_count > 0) {
+		page.index_counts.push_back((GLsizei)batch.index_count);
+		page.index_offsets.push_back((const void*)(batch.first_index * sizeof(uint32_t)));
+		page.base_vertices.push_back((GLint)batch.first_vert);
+	}
+	else {
+		page.firsts.push_back((GLint)batch.first_vert);
+		page.counts.push_back((GLsizei)batch.vert_count);
+	}
+	last_render.batches++;
+}
+
+void MarchingCubes::render(ShaderProgram& shader, glm::mat4 mvp) {
+
+	glUseProgram(shader.ID);
+	shader.setUniformMatrix4fv("mvp", mvp);
+	shader.setUniform3fv("modelColor", base_color);
+	shader.setUniform1i("packed", packed);
+	shader.setUniform3fv("packMin", packed ? pack_min : glm::vec3(0));
+	shader.setUniform3fv("packSize", packed ? pack_size : glm::vec3(1));
+
+	last_render = RenderStats();
+	last_render.pages = pages.size();
+
+	// Gather every batch by page, then draw each page's with one call for triangle lists and one for indexed
+	for (const Batch& batch : buffers)
+		queue_draw(batch);
+	for (const std::vector<Batch>& batches : brick_buffers)
+		for (const Batch& batch : batches)
+			queue_draw(batch);
+
+	if (vao == 0)
+		glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+
+	for (Page& page : pages) {
+		if (page.counts.empty() && page.index_counts.empty())
+			continue;
+		bind_page(page);
+
+		if (!page.counts.empty()) {
+			glMultiDrawArrays(GL_TRIANGLES, page.firsts.data(), page.counts.data(), (GLsizei)page.counts.size());
+			last_render.draw_calls++;
+		}
+		if (!page.index_counts.empty()) {
+			glMultiDrawElementsBaseVertex(GL_TRIANGLES, page.index_counts.data(), GL_UNSIGNED_INT,
+				page.index_offsets.data(), (GLsizei)page.index_counts.size(), page.base_vertices.data());
+			last_render.draw_calls++;
+		}
+
+		page.firsts.clear();
+		page.counts.clear();
+		page.index_counts.clear();
+		page.index_offsets.clear();
+		page.base_vertices.clear();
+	}
+
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
@@ -0,0 +1,47 @@
+#ifndef MESHRENDERER_H
+#define MESHRENDERER_H
+#include <glm/mat4x4.hpp>
+#include "ShaderProgram.h"
+#include "MarchingCubes.h"
+
+// Drawing side of MarchingCubes, kept apart from the extraction so that can be built and run without any GL.
+namespace MarchingCubes {
+
+	extern glm::vec3 base_color;
+
+	// Vertices in each batch the mesh is uploaded into, from the next batch on. Batches are suballocated out of a few
+	// big buffers and drawn together, so this trades how much of a batch can sit empty against how many there are.
+	extern int verts_per_batch;
+
+	// Uploads vertices in 12 bytes rather than 24 from now on: positions as 16 bit fractions of the box from min to max,
+	// which the mesh has to fit in, and normals octahedral encoded. Halves the memory and upload bandwidth for a
+	// position error of 1/65535th of the box. Throws away anything already uploaded, so call it before extracting.
+	void pack_vertices(glm::vec3 min, glm::vec3 max);
+
+	// Uploads whatever the extraction has published since the last call. Render thread only.
+	void update();
+
+	// What the last update() cost, for keeping an eye on uploads per frame
+	struct UploadStats {
+		double milliseconds = 0; // Spent in update(), waits on the GPU included
+		size_t bytes = 0;        // Uploaded
+		size_t waits = 0;        // Times the upload ring was full and had to wait for the GPU to catch up
+		bool persistent = false; // Whether the ring is persistently mapped, rather than mapped per upload
+	};
+	UploadStats upload_stats();
+
+	// What the last render() drew
+	struct RenderStats {
+		size_t draw_calls = 0; // Multi-draw calls, one or two per page
+		size_t batches = 0;    // Drawn by those calls
+		size_t pages = 0;      // Buffers the batches are suballocated from
+	};
+	RenderStats render_stats();
+	void render(ShaderProgram& shader, glm::mat4 mvp);
+
+	// Deletes every GL object the renderer made. Call it before the context goes away, the globals holding them are
+	// destroyed too late to do it themselves.
+	void shutdown();
+};
+
+#endif
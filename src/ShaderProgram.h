@@ -1,6 +1,6 @@
 #ifndef SHADERPROGRAM_H
 #define SHADERPROGRAM_H
-#include <gl/glew.h>
+#include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <map>
@@ -54,7 +54,7 @@ private:
     {
         std::string vscode = "", fscode = "";
         std::ifstream shaderFile;
-        shaderFile.exceptions(std::ifstream::failbit || std::ifstream::badbit); //Set up io exceptions
+        shaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit); //Set up io exceptions
         try
         {
             shaderFile.open(vspath);
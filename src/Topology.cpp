@@ -0,0 +1,163 @@
+#include "Topology.h"
+
+// A face of the cube: its corners counter-clockwise seen from outside the cube, and the edge from each corner to the
+// next. Corners and edges are numbered as in edgeTable.
+struct CubeFace {
+	int corners[4];
+	int edges[4];
+};
+
+const CubeFace faces[6] = {
+	{ {3, 7, 4, 0}, {11, 7, 8, 3} }, // -x
+	{ {1, 5, 6, 2}, {9, 5, 10, 1} }, // +x
+	{ {1, 2, 3, 0}, {1, 2, 3, 0} },  // -y
+	{ {4, 7, 6, 5}, {7, 6, 5, 4} },  // +y
+	{ {4, 5, 1, 0}, {4, 9, 0, 8} },  // -z
+	{ {3, 2, 6, 7}, {2, 10, 6, 11} } // +z
+};
+
+bool inside(int marching_case, int corner) {
+	return (marching_case >> corner & 1) != 0;
+}
+
+bool ambiguous(const CubeFace& face, int marching_case) {
+	bool a = inside(marching_case, face.corners[0]), b = inside(marching_case, face.corners[1]);
+	return a == inside(marching_case, face.corners[2]) && b == inside(marching_case, face.corners[3]) && a != b;
+}
+
+bool has_ambiguous_face(int marching_case) {
+	for (const CubeFace& face : faces)
+		if (ambiguous(face, marching_case))
+			return true;
+	return false;
+}
+
+// Whether edges a and b are both on one of the faces in the mask
+bool share_face(int a, int b, int face_mask) {
+	for (int f = 0; f < 6; f++) {
+		if (!(face_mask >> f & 1))
+			continue;
+		bool has_a = false, has_b = false;
+		for (int e : faces[f].edges) {
+			has_a |= e == a;
+			has_b |= e == b;
+		}
+		if (has_a && has_b)
+			return true;
+	}
+	return false;
+}
+
+int resolve_cell(const float corners[8], float isovalue, int marching_case, uint8_t edges[3 * MAX_RESOLVED_TRIANGLES],
+	uint16_t centres[MAX_CENTRES]) {
+	// Where the outline leaving along each edge goes next, -1 for edges the surface doesn't cross
+	int next[12];
+	for (int& e : next)
+		e = -1;
+
+	int ambiguous_faces = 0;
+	for (int f = 0; f < 6; f++) {
+		const CubeFace& face = faces[f];
+
+		// Walking counter-clockwise round the face, the outline starts where the walk leaves the inside, at edge k
+		// from an inside corner k, and ends where it comes back in, keeping the inside on its left
+		if (!ambiguous(face, marching_case)) {
+			int exit = -1, enter = -1;
+			for (int k = 0; k < 4; k++) {
+				bool from = inside(marching_case, face.corners[k]), to = inside(marching_case, face.corners[(k + 1) % 4]);
+				if (from && !to)
+					exit = k;
+				else if (!from && to)
+					enter = k;
+			}
+			if (exit >= 0)
+				next[face.edges[exit]] = face.edges[enter];
+			continue;
+		}
+
+		// Two outlines. The inside corners are joined across the face if the bilinear interpolant's saddle point is
+		// inside, which for values relative to the isovalue comes down to comparing the products of the two diagonals.
+		// Both cells sharing the face multiply the same pairs, so they can't come out differently.
+		ambiguous_faces |= 1 << f;
+		float w[4];
+		for (int k = 0; k < 4; k++)
+			w[k] = corners[face.corners[k]] - isovalue;
+		int in = inside(marching_case, face.corners[0]) ? 0 : 1;
+		bool joined = w[in] * w[in + 2] > w[1 - in] * w[3 - in];
+
+		// Leaving from inside corner k, joined outlines cut off the outside corner after it, otherwise they cut
+		// off corner k itself
+		for (int k = in; k < 4; k += 2)
+			next[face.edges[k]] = face.edges[joined ? (k + 1) % 4 : (k + 3) % 4];
+	}
+
+	// Every crossed edge is on two faces, leaving one and entering the other, so the outlines close up into loops
+	int triangles = 0, centre_count = 0;
+	bool used[12] = {};
+	for (int start = 0; start < 12; start++) {
+		if (next[start] < 0 || used[start])
+			continue;
+
+		int loop[12], length = 0;
+		for (int e = start; !used[e]; e = next[e]) {
+			used[e] = true;
+			loop[length++] = e;
+		}
+
+		// Triangulate the loop. A new edge across it mustn't join two vertices on an ambiguous face: the cell on the
+		// other side has all four of that face's vertices too, and could make the same edge, leaving it in 4 triangles.
+		// Clipping ears greedily can paint itself into a corner where every edge left is one of those, so the
+		// triangulation is chosen over the whole loop, split[i][j] being the vertex that makes a triangle with i and j
+		// when the part of the loop from i to j can be triangulated, -1 when it can't.
+		int split[12][12];
+		for (int gap = 2; gap < length; gap++)
+			for (int i = 0; i + gap < length; i++) {
+				int j = i + gap;
+				split[i][j] = -1;
+				if (gap < length - 1 && share_face(loop[i], loop[j], ambiguous_faces))
+					continue;
+				for (int k = i + 1; k < j && split[i][j] < 0; k++)
+					if ((k == i + 1 || split[i][k] >= 0) && (k == j - 1 || split[k][j] >= 0))
+						split[i][j] = k;
+			}
+
+		// A tunnel's loop zigzags between two ambiguous faces and has no such triangulation, so it's fanned round a
+		// vertex of its own in the middle of the cell instead, which no other cell has
+		if (split[0][length - 1] < 0) {
+			int centre = CENTRE_VERTEX + centre_count;
+			centres[centre_count] = 0;
+			for (int v = 0; v < length; v++) {
+				centres[centre_count] |= (uint16_t)(1 << loop[v]);
+				edges[3 * triangles] = (uint8_t)loop[(v + 1) % length];
+				edges[3 * triangles + 1] = (uint8_t)loop[v];
+				edges[3 * triangles + 2] = (uint8_t)centre;
+				triangles++;
+			}
+			centre_count++;
+			continue;
+		}
+
+		// Triangles are wound back to front, the outlines run the opposite way round to the LUT's winding
+		int stack[12][2], top = 0;
+		stack[top][0] = 0;
+		stack[top++][1] = length - 1;
+		while (top > 0) {
+			top--;
+			int i = stack[top][0], j = stack[top][1], k = split[i][j];
+			edges[3 * triangles] = (uint8_t)loop[j];
+			edges[3 * triangles + 1] = (uint8_t)loop[k];
+			edges[3 * triangles + 2] = (uint8_t)loop[i];
+			triangles++;
+
+			if (k > i + 1) {
+				stack[top][0] = i;
+				stack[top++][1] = k;
+			}
+			if (j > k + 1) {
+				stack[top][0] = k;
+				stack[top++][1] = j;
+			}
+		}
+	}
+	return triangles;
+}
@@ -0,0 +1,34 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+#include <cstdint>
+
+// Resolving ambiguous faces with the asymptotic decider. A face with two diagonally opposite corners inside and the
+// other two outside could have its two inside corners joined across the face or kept apart. The LUT picks one way
+// per case without looking at the values, so the surface can come apart where the field's interpolant joins up, or
+// the other way round. The decider settles each face from its own 4 values alone, so both cells sharing a face always
+// agree, and the mesh comes out watertight and manifold. (Ambiguity inside the cell, which MC33 also resolves, isn't: every cell
+// still gets a valid surface, it just might not match the trilinear interpolant's topology inside the cell.)
+// Samples exactly at the isovalue, common in integer volumes, count as above it here as they do in the classification,
+// and crossings are kept off the corners, so ties don't stack vertices on a lattice point.
+
+// Most triangles resolve_cell() can make, from one loop through all 12 edges fanned round a centre
+const int MAX_RESOLVED_TRIANGLES = 12;
+
+// Vertices resolve_cell() adds inside the cell are numbered from here on, after the 12 edges. A cell has at most 4
+// loops, so at most 4 of them.
+const int CENTRE_VERTEX = 12;
+const int MAX_CENTRES = 4;
+
+// Whether any face of a cell in this marching case is ambiguous. Only those cells need resolve_cell(), the LUT's
+// triangles are already right for the rest.
+bool has_ambiguous_face(int marching_case);
+
+// Triangulates a cell, given its corner values in the order of the case bits. Traces the surface's outline on each
+// face, settling ambiguous faces with the decider, joins those up into loops and triangulates each loop, wound the
+// same way as the LUT's. Writes 3 vertices per triangle to edges and returns the number of triangles. Vertices below
+// CENTRE_VERTEX are edges, numbered as edgeTable. Vertex CENTRE_VERTEX + c is the average of the crossings on the
+// edges in bitmask centres[c], for loops that can't be triangulated without one.
+int resolve_cell(const float corners[8], float isovalue, int marching_case, uint8_t edges[3 * MAX_RESOLVED_TRIANGLES],
+	uint16_t centres[MAX_CENTRES]);
+
+#endif
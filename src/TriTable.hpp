@@ -1,4 +1,8 @@
-int marching_cubes_lut[256][16] =
+#include <cstdint>
+
+// Triangles of each marching case, 3 edges (see edgeTable) at a time, ended by -1. Only read at compile time to build
+// packed_lut, which is what the marching loop uses.
+constexpr int8_t marching_cubes_lut[256][16] =
 { {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
 {0, 8, 3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
 {0, 1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
@@ -258,17 +262,55 @@ int marching_cubes_lut[256][16] =
 };
 
 
-float vertTable[12][3] = {
-	{0.5f, 0.0f, 0.0f},
-	{1.0f, 0.0f, 0.5f},
-	{0.5f, 0.0f, 1.0f},
-	{0.0f, 0.0f, 0.5f},
-	{0.5f, 1.0f, 0.0f},
-	{1.0f, 1.0f, 0.5f},
-	{0.5f, 1.0f, 1.0f},
-	{0.0f, 1.0f, 0.5f},
-	{0.0f, 0.5f, 0.0f},
-	{1.0f, 0.5f, 0.0f},
-	{1.0f, 0.5f, 1.0f},
-	{0.0f, 0.5f, 1.0f},
-};
\ No newline at end of file
+// The 12 edges of the cube. Corners are numbered by the bits of the marching case: 0-3 go around the bottom
+// (y = 0) face starting at the cell's own corner, 4-7 are the same around the top face. Every edge is listed
+// from its lower end: the offset of that corner from the cell's corner, the axis (0 = x, 1 = y, 2 = z) it runs
+// along, and the two corners it joins in that order.
+struct CubeEdge {
+	int offset[3];
+	int axis;
+	int corners[2];
+};
+
+constexpr CubeEdge edgeTable[12] = {
+	{ {0, 0, 0}, 0, {0, 1} },
+	{ {1, 0, 0}, 2, {1, 2} },
+	{ {0, 0, 1}, 0, {3, 2} },
+	{ {0, 0, 0}, 2, {0, 3} },
+	{ {0, 1, 0}, 0, {4, 5} },
+	{ {1, 1, 0}, 2, {5, 6} },
+	{ {0, 1, 1}, 0, {7, 6} },
+	{ {0, 1, 0}, 2, {4, 7} },
+	{ {0, 0, 0}, 1, {0, 4} },
+	{ {1, 0, 0}, 1, {1, 5} },
+	{ {1, 0, 1}, 1, {2, 6} },
+	{ {0, 0, 1}, 1, {3, 7} },
+};
+
+// The LUT packed small enough to stay in L1 next to the sample slices, 2 KB rather than 16. Each case's edges are
+// the nibbles of one 64 bit word, first edge lowest. A case has at most 15, so the top nibble is free for its triangle
+// count, which the marching loop runs off rather than looking for the -1.
+struct PackedLUT {
+	uint64_t edges[256];
+
+	constexpr int triangles(int marching_case) const { return (int)(edges[marching_case] >> 60); }
+};
+
+constexpr PackedLUT pack_lut() {
+	PackedLUT lut = {};
+	for (int c = 0; c < 256; c++) {
+		int n = 0;
+		while (n < 16 && marching_cubes_lut[c][n] >= 0) {
+			lut.edges[c] |= (uint64_t)marching_cubes_lut[c][n] << (4 * n);
+			n++;
+		}
+		lut.edges[c] |= (uint64_t)(n / 3) << 60;
+	}
+	return lut;
+}
+
+constexpr PackedLUT packed_lut = pack_lut();
+
+static_assert(sizeof(PackedLUT) == 2048, "PackedLUT is one word per case");
+static_assert(packed_lut.triangles(0) == 0 && packed_lut.triangles(255) == 0, "Empty and full cells have no triangles");
+static_assert(packed_lut.triangles(1) == 1 && (packed_lut.edges[1] & 0xFFF) == 0x380, "Case 1 is the triangle 0, 8, 3");
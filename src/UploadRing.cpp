@@ -0,0 +1,119 @@
+#include "UploadRing.h"
+#include <cstring>
+
+// Copies read from the ring at offsets kept to this alignment
+const size_t RING_ALIGNMENT = 16;
+
+void UploadRing::release() {
+	for (GLsync& fence : fences) {
+		if (fence)
+			glDeleteSync(fence);
+		fence = nullptr;
+	}
+	if (buffer != 0) {
+		if (mapped) {
+			glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+			glUnmapBuffer(GL_COPY_READ_BUFFER);
+		}
+		glDeleteBuffers(1, &buffer);
+	}
+	buffer = 0;
+	mapped = nullptr;
+	section = 0;
+	used = 0;
+	dirty = false;
+}
+
+void UploadRing::create() {
+	const size_t total = SECTIONS * SECTION_BYTES;
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+
+	if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage) {
+		// Coherent, so writes are visible to the copies issued after them without flushing
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_COPY_READ_BUFFER, total, nullptr, flags);
+		mapped = (char*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, total, flags);
+		if (!mapped) {
+			// Storage from glBufferStorage is immutable, so orphaning it with glBufferData would fail. Start over
+			// with a fresh buffer instead.
+			glDeleteBuffers(1, &buffer);
+			glGenBuffers(1, &buffer);
+			glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		}
+	}
+	if (!mapped)
+		glBufferData(GL_COPY_READ_BUFFER, total, nullptr, GL_STREAM_DRAW);
+}
+
+void UploadRing::next_section() {
+	if (mapped && dirty) {
+		if (fences[section])
+			glDeleteSync(fences[section]);
+		fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+	dirty = false;
+	section = (section + 1) % SECTIONS;
+	used = 0;
+
+	if (mapped && fences[section]) {
+		// Only waits if the GPU is still a whole ring behind
+		GLenum status = glClientWaitSync(fences[section], 0, 0);
+		if (status == GL_TIMEOUT_EXPIRED) {
+			waits++;
+			while (status == GL_TIMEOUT_EXPIRED)
+				status = glClientWaitSync(fences[section], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		}
+		glDeleteSync(fences[section]);
+		fences[section] = nullptr;
+	}
+	else if (!mapped && section == 0) {
+		// Orphan the old storage, copies still reading it keep it alive until they're done
+		glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+		glBufferData(GL_COPY_READ_BUFFER, SECTIONS * SECTION_BYTES, nullptr, GL_STREAM_DRAW);
+	}
+}
+
+void* UploadRing::reserve(size_t bytes) {
+	if (buffer == 0)
+		create();
+	if (used + bytes > SECTION_BYTES)
+		next_section();
+
+	pending_offset = section * SECTION_BYTES + used;
+	pending_bytes = bytes;
+	used = (used + bytes + RING_ALIGNMENT - 1) / RING_ALIGNMENT * RING_ALIGNMENT;
+	dirty = true;
+
+	if (mapped)
+		return mapped + pending_offset;
+
+	// Nothing the GPU still needs is ever in a range handed out, so there's no need to sync on it
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	return glMapBufferRange(GL_COPY_READ_BUFFER, pending_offset, bytes,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+void UploadRing::copy_to(GLuint target, size_t offset) {
+	glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+	if (!mapped)
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, target);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, pending_offset, offset, pending_bytes);
+	bytes_uploaded += pending_bytes;
+}
+
+void UploadRing::upload(GLuint target, size_t offset, const void* data, size_t bytes) {
+	std::memcpy(reserve(bytes), data, bytes);
+	copy_to(target, offset);
+}
+
+void UploadRing::end_frame() {
+	if (!mapped || !dirty)
+		return;
+	if (fences[section])
+		glDeleteSync(fences[section]);
+	fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	dirty = false;
+}
@@ -0,0 +1,53 @@
+#ifndef UPLOADRING_H
+#define UPLOADRING_H
+#include <GL/glew.h>
+#include <cstddef>
+
+// Staging memory that mesh data goes through on its way into the draw buffers. Data is written straight into a
+// mapped buffer, then the GPU copies it on into place with glCopyBufferSubData, rather than the driver taking its
+// own copy of every glBufferSubData call to stage it.
+//
+// With GL 4.4 or ARB_buffer_storage the ring is mapped once, persistently. It's split into sections that are
+// written in turn, each fenced once it's been filled so it's only written over after the GPU has finished copying
+// out of it. Older contexts map each upload's range on its own instead, orphaning the buffer whenever the ring
+// wraps around so the driver hands over fresh memory rather than waiting.
+//
+// Needs a current GL context, and only the render thread may use it. Nothing is freed on destruction, since that can
+// come after the context is gone: call release() while it's still current.
+class UploadRing {
+public:
+	// Deletes the buffer and fences. The ring can still be used afterwards, it's created again on the next reserve().
+	void release();
+
+	// Returns room for bytes, at most SECTION_BYTES, to write data for copy_to() into
+	void* reserve(size_t bytes);
+
+	// Has the GPU copy what was written at the last reserve() into buffer at offset
+	void copy_to(GLuint buffer, size_t offset);
+
+	void upload(GLuint buffer, size_t offset, const void* data, size_t bytes);
+
+	// Fences what was written this frame, so a section written over several frames is covered
+	void end_frame();
+
+	bool persistent() const { return mapped != nullptr; }
+	size_t bytes_uploaded = 0; // Since the counters were last reset
+	size_t waits = 0;          // Times the next section was still being copied out of
+
+	static const size_t SECTIONS = 3;
+	static const size_t SECTION_BYTES = 4 << 20;
+
+private:
+	void create();
+	void next_section();
+
+	GLuint buffer = 0;
+	char* mapped = nullptr;  // Whole ring when persistent
+	GLsync fences[SECTIONS] = {};
+	size_t section = 0;
+	size_t used = 0;         // Bytes of the current section written
+	size_t pending_offset = 0, pending_bytes = 0; // Last reserve()
+	bool dirty = false;      // Written since the last fence
+};
+
+#endif
@@ -0,0 +1,327 @@
+#include "Volume.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cctype>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Reads a T stored at p, reversing its bytes if the file's byte order isn't the host's
+template <typename T>
+T load(const uint8_t* p, bool swap) {
+	uint8_t bytes[sizeof(T)];
+	std::memcpy(bytes, p, sizeof(T));
+	if (swap)
+		std::reverse(bytes, bytes + sizeof(T));
+
+	T value;
+	std::memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+bool big_endian_host() {
+	const uint16_t probe = 1;
+	return *(const uint8_t*)&probe == 0;
+}
+
+std::string trim(const std::string& text) {
+	size_t begin = text.find_first_not_of(" \t\r");
+	size_t end = text.find_last_not_of(" \t\r");
+	return begin == std::string::npos ? "" : text.substr(begin, end - begin + 1);
+}
+
+// Reads the numbers out of text, skipping anything else in between, e.g. "(0.5,0,0) (0,0.5,0)"
+std::vector<double> parse_numbers(const std::string& text) {
+	std::vector<double> numbers;
+	const char* p = text.c_str();
+	while (*p != '\0') {
+		char* end;
+		double value = std::strtod(p, &end);
+		if (end == p) {
+			p++;
+			continue;
+		}
+		numbers.push_back(value);
+		p = end;
+	}
+	return numbers;
+}
+
+bool parse_type(std::string name, Volume::Type& type) {
+	std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+	if (name == "uchar" || name == "unsigned char" || name == "uint8" || name == "uint8_t")
+		type = Volume::Type::UInt8;
+	else if (name == "ushort" || name == "unsigned short" || name == "unsigned short int" || name == "uint16" || name == "uint16_t")
+		type = Volume::Type::UInt16;
+	else if (name == "float")
+		type = Volume::Type::Float32;
+	else
+		return false;
+	return true;
+}
+
+bool Volume::open_nrrd(const std::string& path) {
+	close();
+
+	std::ifstream header(path, std::ios::binary);
+	std::string line;
+	if (!header || !std::getline(header, line) || line.compare(0, 7, "NRRD000") != 0) {
+		std::cout << path << " isn't an NRRD file" << std::endl;
+		return false;
+	}
+
+	// The header runs up to a blank line, after which the data starts unless it's in a file of its own
+	Layout layout;
+	size_t header_bytes = line.size() + 1;
+	std::string data_file;
+	long long byte_skip = 0;
+	bool have_sizes = false, have_type = false;
+
+	while (std::getline(header, line)) {
+		header_bytes += line.size() + 1;
+		line = trim(line);
+		if (line.empty())
+			break;
+		if (line[0] == '#')
+			continue;
+
+		size_t colon = line.find(':');
+		if (colon == std::string::npos || (colon + 1 < line.size() && line[colon + 1] == '='))
+			continue; // Not a field, or a key/value pair we don't need
+		std::string field = trim(line.substr(0, colon));
+		std::string value = trim(line.substr(colon + 1));
+		std::transform(field.begin(), field.end(), field.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+		std::vector<double> numbers = parse_numbers(value);
+
+		if (field == "type") {
+			if (!parse_type(value, layout.type)) {
+				std::cout << path << ": voxels of type " << value << " aren't supported, only uint8, uint16 and float" << std::endl;
+				return false;
+			}
+			have_type = true;
+		}
+		else if (field == "dimension" && value != "3") {
+			std::cout << path << ": only 3 dimensional volumes are supported" << std::endl;
+			return false;
+		}
+		else if (field == "sizes" && numbers.size() == 3) {
+			for (int axis = 0; axis < 3; axis++)
+				layout.dims[axis] = (size_t)numbers[axis];
+			have_sizes = true;
+		}
+		else if (field == "spacings" && numbers.size() == 3)
+			layout.spacing = glm::vec3((float)numbers[0], (float)numbers[1], (float)numbers[2]);
+		else if (field == "space directions" && numbers.size() == 9) {
+			// Only the length of each axis is used, volumes are taken to be axis aligned
+			for (int axis = 0; axis < 3; axis++)
+				layout.spacing[axis] = (float)std::sqrt(numbers[3 * axis] * numbers[3 * axis]
+					+ numbers[3 * axis + 1] * numbers[3 * axis + 1] + numbers[3 * axis + 2] * numbers[3 * axis + 2]);
+		}
+		else if (field == "space origin" && numbers.size() == 3)
+			layout.origin = glm::vec3((float)numbers[0], (float)numbers[1], (float)numbers[2]);
+		else if (field == "encoding" && value != "raw") {
+			std::cout << path << ": " << value << " encoding isn't supported, only raw can be memory mapped" << std::endl;
+			return false;
+		}
+		else if (field == "endian")
+			layout.big_endian = value == "big";
+		else if (field == "byte skip" && !numbers.empty())
+			byte_skip = (long long)numbers[0];
+		else if (field == "line skip" && !numbers.empty() && numbers[0] != 0) {
+			std::cout << path << ": line skip isn't supported" << std::endl;
+			return false;
+		}
+		else if (field == "data file" || field == "datafile")
+			data_file = value;
+	}
+
+	if (!have_sizes || !have_type) {
+		std::cout << path << ": header is missing its sizes or type" << std::endl;
+		return false;
+	}
+
+	// Detached data files are relative to the header
+	std::string data_path = path;
+	if (!data_file.empty()) {
+		size_t slash = path.find_last_of("/\\");
+		bool absolute = data_file[0] == '/' || data_file[0] == '\\' || (data_file.size() > 1 && data_file[1] == ':');
+		data_path = absolute || slash == std::string::npos ? data_file : path.substr(0, slash + 1) + data_file;
+		header_bytes = 0;
+	}
+
+	format = layout;
+	if (!map(data_path))
+		return false;
+
+	// A byte skip of -1 means the data is the last thing in the file
+	size_t data_bytes = format.dims[0] * format.dims[1] * format.dims[2] * voxel_bytes();
+	if (byte_skip == -1)
+		format.offset = size >= data_bytes ? size - data_bytes : 0;
+	else
+		format.offset = header_bytes + (size_t)std::max(0LL, byte_skip);
+
+	return check_layout(data_path);
+}
+
+bool Volume::open_raw(const std::string& path, const Layout& layout) {
+	close();
+	format = layout;
+	return map(path) && check_layout(path);
+}
+
+// Makes sure the voxels the layout describes are all in the file
+bool Volume::check_layout(const std::string& path) {
+	for (int axis = 0; axis < 3; axis++)
+		if (format.dims[axis] < 2) {
+			std::cout << path << ": need at least 2 voxels along every axis to make any cells" << std::endl;
+			close();
+			return false;
+		}
+
+	size_t data_bytes = format.dims[0] * format.dims[1] * format.dims[2] * voxel_bytes();
+	if (format.offset > size || size - format.offset < data_bytes) {
+		std::cout << path << ": file is " << size << " bytes, too small for " << format.dims[0] << "x" << format.dims[1]
+			<< "x" << format.dims[2] << " voxels starting at byte " << format.offset << std::endl;
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool Volume::map(const std::string& path) {
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	LARGE_INTEGER file_size;
+	if (handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(handle, &file_size) || file_size.QuadPart == 0) {
+		std::cout << "Couldn't open " << path << std::endl;
+		if (handle != INVALID_HANDLE_VALUE)
+			CloseHandle(handle);
+		return false;
+	}
+
+	HANDLE view = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const void* address = view ? MapViewOfFile(view, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (address == nullptr) {
+		std::cout << "Couldn't map " << path << std::endl;
+		if (view)
+			CloseHandle(view);
+		CloseHandle(handle);
+		return false;
+	}
+
+	file = handle;
+	mapping = view;
+	size = (size_t)file_size.QuadPart;
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	struct stat info;
+	if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+		std::cout << "Couldn't open " << path << std::endl;
+		if (fd >= 0)
+			::close(fd);
+		return false;
+	}
+
+	// The mapping keeps the file open by itself
+	void* address = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (address == MAP_FAILED) {
+		std::cout << "Couldn't map " << path << std::endl;
+		return false;
+	}
+	size = (size_t)info.st_size;
+#endif
+	data = (const uint8_t*)address;
+	return true;
+}
+
+void Volume::close() {
+	if (data == nullptr)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+	CloseHandle(mapping);
+	CloseHandle(file);
+	mapping = nullptr;
+	file = nullptr;
+#else
+	munmap((void*)data, size);
+#endif
+	data = nullptr;
+	size = 0;
+}
+
+size_t Volume::voxel_bytes() const {
+	switch (format.type) {
+	case Type::UInt16: return 2;
+	case Type::Float32: return 4;
+	default: return 1;
+	}
+}
+
+MarchingCubes::Lattice Volume::lattice() const {
+	if (data == nullptr)
+		return MarchingCubes::Lattice();
+	return MarchingCubes::Lattice(format.dims[0] - 1, format.dims[1] - 1, format.dims[2] - 1, format.origin, format.spacing);
+}
+
+float Volume::voxel(size_t x, size_t y, size_t z) const {
+	const uint8_t* p = data + format.offset + ((z * format.dims[1] + y) * format.dims[0] + x) * voxel_bytes();
+	const bool swap = format.big_endian != big_endian_host();
+	switch (format.type) {
+	case Type::UInt16: return (float)load<uint16_t>(p, swap);
+	case Type::Float32: return load<float>(p, swap);
+	default: return (float)*p;
+	}
+}
+
+template <typename T>
+void Volume::read_slice(size_t k, std::vector<float>& slice) const {
+	const size_t nx = format.dims[0], ny = format.dims[1];
+	const uint8_t* plane = data + format.offset + k * nx * ny * sizeof(T);
+	const bool swap = sizeof(T) > 1 && format.big_endian != big_endian_host();
+
+	// The file has x running fastest and slices have y, so read rows of x in order and scatter them
+	for (size_t y = 0; y < ny; y++) {
+		const uint8_t* row = plane + y * nx * sizeof(T);
+		for (size_t x = 0; x < nx; x++)
+			slice[x * ny + y] = (float)load<T>(row + x * sizeof(T), swap);
+	}
+}
+
+void Volume::prefetch(size_t k) const {
+	if (k >= format.dims[2])
+		return;
+#ifndef _WIN32
+	// madvise wants a page aligned start
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t slice_bytes = format.dims[0] * format.dims[1] * voxel_bytes();
+	size_t begin = format.offset + k * slice_bytes;
+	size_t aligned = begin - begin % page;
+	posix_madvise((void*)(data + aligned), begin + slice_bytes - aligned, POSIX_MADV_WILLNEED);
+#endif
+	// Windows reads ahead on its own, the file is opened for sequential scanning
+}
+
+MarchingCubes::SliceSampler Volume::sampler() const {
+	return [this](const MarchingCubes::Lattice&, size_t k, std::vector<float>& slice) {
+		prefetch(k + 1);
+		switch (format.type) {
+		case Type::UInt16: read_slice<uint16_t>(k, slice); break;
+		case Type::Float32: read_slice<float>(k, slice); break;
+		default: read_slice<uint8_t>(k, slice); break;
+		}
+	};
+}
@@ -0,0 +1,72 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <glm/vec3.hpp>
+#include "MarchingCubes.h"
+
+// A grid of voxels in a file, such as a CT scan or a simulation dump, to extract surfaces from. The file is memory
+// mapped rather than read in, so volumes bigger than RAM work, slices are only paged in as the extractor reaches
+// them, and the OS page cache keeps them around for the next run.
+// Voxel (x, y, z) is at index (z * ny + y) * nx + x, x fastest, which is how raw volumes and NRRD lay them out.
+class Volume {
+public:
+	enum class Type { UInt8, UInt16, Float32 };
+
+	// Everything needed to find the voxels in the file. NRRD headers fill this in, raw files need it given.
+	struct Layout {
+		size_t dims[3] = { 0, 0, 0 };        // Voxels along x, y and z
+		Type type = Type::UInt8;
+		glm::vec3 spacing = glm::vec3(1);   // Distance between voxel centres
+		glm::vec3 origin = glm::vec3(0);    // Position of voxel (0, 0, 0)
+		size_t offset = 0;                  // Bytes before the first voxel
+		bool big_endian = false;
+	};
+
+	Volume() = default;
+	~Volume() { close(); }
+	Volume(const Volume&) = delete;
+	Volume& operator=(const Volume&) = delete;
+
+	// Maps a .nrrd file, or a .nhdr header and the data file it points to. Only raw encoding is supported.
+	// Prints what's wrong and returns false if the volume can't be used.
+	bool open_nrrd(const std::string& path);
+
+	// Maps a file that's nothing but voxels, laid out as given
+	bool open_raw(const std::string& path, const Layout& layout);
+
+	void close();
+
+	const Layout& layout() const { return format; }
+
+	// One lattice point per voxel, so cells are the spaces between 8 voxel centres
+	MarchingCubes::Lattice lattice() const;
+
+	// Reads z-planes of voxels out of the mapping for extract_slices(). The volume has to outlive the extraction.
+	MarchingCubes::SliceSampler sampler() const;
+
+	float voxel(size_t x, size_t y, size_t z) const;
+
+private:
+	bool map(const std::string& path);
+	bool check_layout(const std::string& path);
+	size_t voxel_bytes() const;
+
+	template <typename T>
+	void read_slice(size_t k, std::vector<float>& slice) const;
+
+	// Asks the OS to start reading z-plane k in, so it's ready by the time the extractor gets to it
+	void prefetch(size_t k) const;
+
+	Layout format;
+	const uint8_t* data = nullptr; // The whole file
+	size_t size = 0;
+#ifdef _WIN32
+	void* file = nullptr;
+	void* mapping = nullptr;
+#endif
+};
+
+#endif